@@ -1,10 +1,26 @@
-clang++-14 -o eva-llvm `llvm-config-14 --cxxflags --ldflags --system-libs --libs core` -fexceptions eva-llvm.cpp
+clang++-14 -o eva-llvm `llvm-config-14 --cxxflags --ldflags --system-libs --libs core orcjit native passes` -fexceptions eva-llvm.cpp
 
 ./eva-llvm
 
 #lli-14 ./out.ll
 clang++-14 -O3 -I/usr/include/gc ./out.ll -L/usr/lib/x86_64-linux-gnu/gc -lgc -o ./out
 
+# PGO: ./eva-llvm --pgo-gen ..., then build the instrumented binary with
+#   clang++-14 -O3 -c ./out.ll -o ./out.o
+#   clang++-14 -fprofile-generate ./out.o -L/usr/lib/x86_64-linux-gnu/gc -lgc -o ./out
+# run ./out,
+# llvm-profdata-14 merge -o eva.profdata default_*.profraw,
+# then ./eva-llvm --pgo-use=eva.profdata ... and rebuild.
+
+# Precise GC: ./eva-llvm --gc=statepoint ..., then link the runtime instead of -lgc
+#   clang-14 -O2 -fno-omit-frame-pointer -c src/runtime/EvaGC.c -o EvaGC.o
+#   clang++-14 -O3 -no-pie ./out.ll EvaGC.o -o ./out
+# (EVA_GC_STATS=1 ./out prints collection counts and pause times.)
+
+# Separate compilation: ./eva-llvm -f main.eva --build-dir=build compiles main.eva and
+# the files it imports to objects in build/, recompiling only what changed, and prints them:
+#   clang++-14 $(./eva-llvm -f main.eva --build-dir=build) -L/usr/lib/x86_64-linux-gnu/gc -lgc -o ./out
+
 ./out
 
 echo $?
@@ -1,44 +1,180 @@
+#include "./src/EvaBuild.h"
 #include "./src/EvaLLVM.h"
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <new>
+
+void *operator new(size_t size)
+{
+    auto &counter = allocCounter();
+    counter.count++;
+    counter.bytes += size;
+
+    if (auto ptr = std::malloc(size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
 
 void printHelp()
 {
     std::cout << "\nUseage: eva-llvm [options]\n\n"
               << "Options: \n"
               << "      -e, --expression Expression to parse\n"
-              << "      -f, --file       File to parse\n\n";
+              << "      -f, --file       File to parse\n"
+              << "      -j, --jit        Run the program in-process after compiling\n"
+              << "      --instrument=counters,allocs,fields\n"
+              << "                       Count function entries and loop iterations,\n"
+              << "                       allocations per class, and field accesses\n"
+              << "      --field-profile=<file>\n"
+              << "                       Lay out hot fields first, from a fields report\n"
+              << "      --mem-report     Print compiler memory usage per phase\n"
+              << "      --pgo-gen        Instrument for profiling, link with -fprofile-generate\n"
+              << "      --pgo-use=<file> Apply an llvm-profdata merged profile\n"
+              << "      --gc=boehm|statepoint\n"
+              << "                       Conservative Boehm GC (default), or the precise\n"
+              << "                       generational collector (src/runtime/EvaGC.c, no --jit)\n"
+              << "      --build-dir=<dir>\n"
+              << "                       Compile each imported file to its own object in\n"
+              << "                       <dir>, reusing unchanged ones, and print their paths\n\n";
 }
 
 int main(int argc, const char *argv[])
 {
-    if (argc != 3)
+    std::string mode;
+    std::string input;
+    std::string buildDir;
+    CompileOptions options;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if ((arg == "-e" || arg == "--expression" || arg == "-f" || arg == "--file") && i + 1 < argc)
+        {
+            mode = arg;
+            input = argv[++i];
+        }
+        else if (arg == "-j" || arg == "--jit")
+        {
+            options.jit = true;
+        }
+        else if (arg == "--mem-report")
+        {
+            options.memReport = true;
+        }
+        else if (arg == "--pgo-gen")
+        {
+            options.pgoGen = true;
+        }
+        else if (arg.rfind("--pgo-use=", 0) == 0)
+        {
+            options.pgoUse = arg.substr(std::string("--pgo-use=").size());
+        }
+        else if (arg == "--gc=boehm" || arg == "--gc=statepoint")
+        {
+            options.gc = arg.substr(std::string("--gc=").size());
+        }
+        else if (arg.rfind("--field-profile=", 0) == 0)
+        {
+            options.fieldProfile = arg.substr(std::string("--field-profile=").size());
+        }
+        else if (arg.rfind("--build-dir=", 0) == 0)
+        {
+            buildDir = arg.substr(std::string("--build-dir=").size());
+        }
+        else if (arg.rfind("--instrument=", 0) == 0)
+        {
+            std::stringstream modes(arg.substr(std::string("--instrument=").size()));
+            std::string instrumentMode;
+
+            while (std::getline(modes, instrumentMode, ','))
+            {
+                if (instrumentMode == "counters")
+                {
+                    options.instrumentCounters = true;
+                }
+                else if (instrumentMode == "allocs")
+                {
+                    options.instrumentAllocs = true;
+                }
+                else if (instrumentMode == "fields")
+                {
+                    options.instrumentFields = true;
+                }
+                else
+                {
+                    printHelp();
+                    return 0;
+                }
+            }
+        }
+        else
+        {
+            printHelp();
+            return 0;
+        }
+    }
+
+    if (mode.empty() || (options.pgoGen && (options.jit || !options.pgoUse.empty())) ||
+        (options.gc == "statepoint" && options.jit) ||
+        (!buildDir.empty() && (mode == "-e" || mode == "--expression" || options.jit ||
+                               options.gc != "boehm" || options.pgoGen || !options.pgoUse.empty() ||
+                               options.instrumentCounters || options.instrumentAllocs ||
+                               options.instrumentFields)))
     {
         printHelp();
         return 0;
     }
 
-    std::string mode = argv[1];
+    if (options.memReport)
+    {
+        MemReport::get().phase("startup");
+    }
 
     std::string program;
 
-    if (mode == "-e")
+    if (mode == "-e" || mode == "--expression")
     {
-        program = argv[2];
+        program = input;
     }
-    else if (mode == "-f")
+    else
     {
-        std::ifstream programFile(argv[2]);
+        std::ifstream programFile(input);
         std::stringstream buffer;
         buffer << programFile.rdbuf();
 
         program = buffer.str();
     }
 
-    EvaLLVM vm;
+    if (options.memReport)
+    {
+        MemReport::get().phase("read");
+    }
+
+    if (!buildDir.empty())
+    {
+        for (const auto &object : EvaBuild(options, buildDir).build(input, program))
+        {
+            std::cout << object << "\n";
+        }
+        return 0;
+    }
 
-    vm.exec(program);
+    EvaLLVM vm(options);
 
-    return 0;
-}
\ No newline at end of file
+    auto isFile = mode == "-f" || mode == "--file";
+    return vm.exec(program, isFile ? input : "");
+}
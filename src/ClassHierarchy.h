@@ -0,0 +1,178 @@
+#ifndef ClassHierarchy_h
+#define ClassHierarchy_h
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./parser/EvaParser.h"
+
+/**
+ * Whole-program class hierarchy, collected from every `class` form
+ * before codegen starts.
+ */
+class ClassHierarchy
+{
+public:
+    void collect(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return;
+        }
+
+        if (exp.list.size() == 4 && exp.list[0].type == ExpType::SYMBOL &&
+            exp.list[0].string == "class")
+        {
+            auto className = exp.list[1].string;
+            auto parentName = exp.list[2].string;
+
+            auto &classNode = classes_[className];
+            classNode.parent = parentName == "null" ? "" : parentName;
+
+            for (const auto &member : exp.list[3].list)
+            {
+                if (member.type == ExpType::LIST && !member.list.empty() &&
+                    member.list[0].type == ExpType::SYMBOL && member.list[0].string == "def")
+                {
+                    classNode.methods.insert(member.list[1].string);
+                }
+            }
+
+            if (!classNode.parent.empty())
+            {
+                classes_[classNode.parent].children.push_back(className);
+            }
+        }
+
+        for (const auto &child : exp.list)
+        {
+            collect(child);
+        }
+    }
+
+    /**
+     * The class whose definition of `methodName` is used by instances
+     * of `className`, or "" if none.
+     */
+    std::string resolve(const std::string &className, const std::string &methodName)
+    {
+        auto current = className;
+
+        while (!current.empty())
+        {
+            auto it = classes_.find(current);
+            if (it == classes_.end())
+            {
+                return "";
+            }
+            if (it->second.methods.count(methodName) != 0)
+            {
+                return current;
+            }
+            current = it->second.parent;
+        }
+
+        return "";
+    }
+
+    /**
+     * Adds an instance of a generic class. It inherits the template's
+     * subclass templates as children, since they may be instantiated
+     * with it as parent later on.
+     */
+    void instantiate(const std::string &templateName, const Exp &instanceExp)
+    {
+        collect(instanceExp);
+
+        auto instanceName = instanceExp.list[1].string;
+        for (const auto &child : classes_[templateName].children)
+        {
+            classes_[instanceName].children.push_back(child);
+        }
+    }
+
+    /**
+     * Whether every subclass is known. A separately compiled module can
+     * be imported, and its classes extended, by modules it cannot see.
+     */
+    bool isClosedWorld()
+    {
+        return closedWorld_;
+    }
+
+    void setClosedWorld(bool closedWorld)
+    {
+        closedWorld_ = closedWorld;
+    }
+
+    std::string parentOf(const std::string &className)
+    {
+        auto it = classes_.find(className);
+        return it == classes_.end() ? "" : it->second.parent;
+    }
+
+    /**
+     * Every class whose definition of `methodName` can be reached from
+     * an instance whose static type is `className`.
+     */
+    std::set<std::string> implementations(const std::string &className, const std::string &methodName)
+    {
+        std::set<std::string> impls;
+
+        auto impl = resolve(className, methodName);
+        if (!impl.empty())
+        {
+            impls.insert(impl);
+        }
+
+        std::vector<std::string> worklist{className};
+        while (!worklist.empty())
+        {
+            auto current = worklist.back();
+            worklist.pop_back();
+
+            for (const auto &child : classes_[current].children)
+            {
+                if (classes_[child].methods.count(methodName) != 0)
+                {
+                    impls.insert(child);
+                }
+                worklist.push_back(child);
+            }
+        }
+
+        return impls;
+    }
+
+    /**
+     * The single class providing `methodName` for every instance whose
+     * static type is `className` (the class and all its subclasses),
+     * or "" if dispatch has more than one target.
+     */
+    std::string uniqueImplementation(const std::string &className, const std::string &methodName)
+    {
+        if (!closedWorld_)
+        {
+            return "";
+        }
+
+        auto impls = implementations(className, methodName);
+        return impls.size() == 1 ? *impls.begin() : "";
+    }
+
+private:
+    struct ClassNode
+    {
+        std::string parent;
+        std::set<std::string> methods;
+        std::vector<std::string> children;
+    };
+
+    std::map<std::string, ClassNode> classes_;
+
+    bool closedWorld_ = true;
+};
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef ConstantFolder_h
+#define ConstantFolder_h
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+
+#include "./parser/EvaParser.h"
+
+/**
+ * AST simplification run before codegen:
+ *
+ *   (+ 3 4)              => 7, likewise for - * / and comparisons
+ *   (if true a b)        => a
+ *   (while false body)   => 0
+ *   x                    => 5, for a top-level `(var x 5)` never `set`
+ *
+ * Folding follows codegen's typing: `number` arithmetic wraps at 32
+ * bits, and results that would change a value's LLVM type are left to
+ * the optimizer.
+ */
+class ConstantFolder
+{
+public:
+    Exp fold(const Exp &program)
+    {
+        collectAssigned(program);
+        return foldBlock(program, {}, true);
+    }
+
+private:
+    using Scope = std::set<std::string>;
+
+    /**
+     * Names that are the target of some `(set name ...)`; they are
+     * never treated as constants.
+     */
+    void collectAssigned(const Exp &exp)
+    {
+        if (isTagged(exp, "set") && exp.list[1].type == ExpType::SYMBOL)
+        {
+            assigned_.insert(exp.list[1].string);
+        }
+        for (const auto &child : exp.list)
+        {
+            collectAssigned(child);
+        }
+    }
+
+    Exp fold(const Exp &exp, const Scope &scope)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            auto constant = constants_.find(exp.string);
+            if (constant != constants_.end() && scope.count(exp.string) == 0)
+            {
+                return constant->second;
+            }
+            return exp;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty() || exp.list[0].type != ExpType::SYMBOL)
+        {
+            return foldChildren(exp, 0, scope);
+        }
+
+        auto &op = exp.list[0].string;
+
+        if (op == "begin" || op == "with-arena")
+        {
+            return foldBlock(exp, scope, false);
+        }
+
+        if (op == "def")
+        {
+            return foldFunction(exp, 2, scope);
+        }
+
+        if (op == "lambda")
+        {
+            return foldFunction(exp, 1, scope);
+        }
+
+        if (op == "class" || op == "struct")
+        {
+            auto folded = exp;
+            for (auto &member : folded.list.back().list)
+            {
+                if (isTagged(member, "var"))
+                {
+                    member.list[2] = fold(member.list[2], scope);
+                }
+                else if (isTagged(member, "def"))
+                {
+                    member = foldFunction(member, 2, scope);
+                }
+            }
+            return folded;
+        }
+
+        if (op == "for" && exp.list.size() == 5)
+        {
+            auto folded = foldChildren(exp, 2, scope);
+            auto bodyScope = scope;
+            bodyScope.insert(exp.list[1].string);
+            folded.list[4] = fold(exp.list[4], bodyScope);
+            return folded;
+        }
+
+        if (op == "var" || op == "new" || op == "array")
+        {
+            return foldChildren(exp, 2, scope);
+        }
+
+        if (op == "set" && exp.list[1].type == ExpType::SYMBOL)
+        {
+            return foldChildren(exp, 2, scope);
+        }
+
+        if (op == "prop" || op == "method")
+        {
+            auto folded = exp;
+            folded.list[1] = fold(exp.list[1], scope);
+            return folded;
+        }
+
+        if (op == "super")
+        {
+            return exp;
+        }
+
+        if (op == "if" && exp.list.size() == 4)
+        {
+            return foldIf(exp, scope);
+        }
+
+        if (op == "while" && exp.list.size() == 3)
+        {
+            auto cond = fold(exp.list[1], scope);
+            if (isBoolean(cond, false))
+            {
+                return Exp(int64_t{0});
+            }
+            auto folded = exp;
+            folded.list[1] = cond;
+            folded.list[2] = fold(exp.list[2], scope);
+            return folded;
+        }
+
+        auto folded = foldChildren(exp, 1, scope);
+        if (folded.list.size() == 3 && isOperator(op))
+        {
+            return foldBinary(folded);
+        }
+        return folded;
+    }
+
+    Exp foldChildren(const Exp &exp, size_t first, const Scope &scope)
+    {
+        auto folded = exp;
+        for (auto i = first; i < exp.list.size(); i++)
+        {
+            folded.list[i] = fold(exp.list[i], scope);
+        }
+        return folded;
+    }
+
+    /**
+     * Folds a `begin` body in order, so each statement sees the
+     * bindings made before it. Literals whose value is unused are
+     * dropped.
+     */
+    Exp foldBlock(const Exp &exp, Scope scope, bool topLevel)
+    {
+        Exp folded(std::vector<Exp>{exp.list[0]});
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            auto stmt = fold(exp.list[i], scope);
+
+            if (isTagged(stmt, "var") || isTagged(stmt, "def"))
+            {
+                auto &decl = stmt.list[1];
+                auto name = decl.type == ExpType::LIST ? decl.list[0].string : decl.string;
+
+                Exp value(int64_t{0});
+                if (topLevel && isTagged(stmt, "var") && assigned_.count(name) == 0 &&
+                    constantValue(decl, stmt.list[2], value))
+                {
+                    constants_.erase(name);
+                    constants_.emplace(name, value);
+                }
+                else if (topLevel)
+                {
+                    constants_.erase(name);
+                }
+                else
+                {
+                    scope.insert(name);
+                }
+            }
+
+            if (i < exp.list.size() - 1 && !literalType(stmt).empty())
+            {
+                continue;
+            }
+            folded.list.push_back(stmt);
+        }
+
+        return folded;
+    }
+
+    /**
+     * A `def` or `lambda`, whose parameter list is at `paramsIdx`.
+     */
+    Exp foldFunction(const Exp &exp, size_t paramsIdx, const Scope &scope)
+    {
+        if (exp.list.size() <= paramsIdx || exp.list[paramsIdx].type != ExpType::LIST)
+        {
+            return exp;
+        }
+
+        auto bodyScope = scope;
+        for (const auto &param : exp.list[paramsIdx].list)
+        {
+            bodyScope.insert(param.type == ExpType::LIST ? param.list[0].string : param.string);
+        }
+
+        auto folded = exp;
+        folded.list.back() = fold(exp.list.back(), bodyScope);
+        return folded;
+    }
+
+    Exp foldIf(const Exp &exp, const Scope &scope)
+    {
+        auto folded = foldChildren(exp, 1, scope);
+        auto &cond = folded.list[1];
+
+        if (!isBoolean(cond, true) && !isBoolean(cond, false))
+        {
+            return folded;
+        }
+
+        auto taken = folded.list[isBoolean(cond, true) ? 2 : 3];
+        auto other = folded.list[isBoolean(cond, true) ? 3 : 2];
+
+        // Codegen unifies the arms' types; keep that for literal arms.
+        auto takenTy = literalType(taken);
+        auto otherTy = literalType(other);
+        if (takenTy.empty() || otherTy.empty() || takenTy == otherTy)
+        {
+            return taken;
+        }
+        if (taken.type == ExpType::NUMBER && other.type == ExpType::FLOAT)
+        {
+            return floatExp(taken.number);
+        }
+        if (taken.type == ExpType::FLOAT && other.type == ExpType::NUMBER)
+        {
+            return taken;
+        }
+        return folded;
+    }
+
+    Exp foldBinary(const Exp &exp)
+    {
+        auto &op = exp.list[0].string;
+        auto &lhs = exp.list[1];
+        auto &rhs = exp.list[2];
+
+        if ((op == "==" || op == "!=") && literalType(lhs) == "boolean" && literalType(rhs) == "boolean")
+        {
+            return boolExp((lhs.string == rhs.string) == (op == "=="));
+        }
+
+        if (!isNumber(lhs) || !isNumber(rhs))
+        {
+            return exp;
+        }
+
+        if (lhs.type == ExpType::FLOAT || rhs.type == ExpType::FLOAT)
+        {
+            auto a = toDouble(lhs), b = toDouble(rhs);
+
+            if (op == "+") return floatExp(a + b);
+            if (op == "-") return floatExp(a - b);
+            if (op == "*") return floatExp(a * b);
+            if (op == "/") return floatExp(a / b);
+            if (op == ">") return boolExp(a > b);
+            if (op == "<") return boolExp(a < b);
+            if (op == "==") return boolExp(a == b);
+            if (op == "!=") return boolExp(a != b);
+            if (op == ">=") return boolExp(a >= b);
+            if (op == "<=") return boolExp(a <= b);
+            return exp;
+        }
+
+        auto a = lhs.number, b = rhs.number;
+
+        if (op == ">") return boolExp(a > b);
+        if (op == "<") return boolExp(a < b);
+        if (op == "==") return boolExp(a == b);
+        if (op == "!=") return boolExp(a != b);
+        if (op == ">=") return boolExp(a >= b);
+        if (op == "<=") return boolExp(a <= b);
+
+        auto wide = literalType(lhs) == "i64" || literalType(rhs) == "i64";
+        auto minValue = wide ? INT64_MIN : int64_t{INT32_MIN};
+
+        uint64_t result;
+        if (op == "+")
+        {
+            result = uint64_t(a) + uint64_t(b);
+        }
+        else if (op == "-")
+        {
+            result = uint64_t(a) - uint64_t(b);
+        }
+        else if (op == "*")
+        {
+            result = uint64_t(a) * uint64_t(b);
+        }
+        else if (op == "/" && b != 0 && !(a == minValue && b == -1))
+        {
+            result = uint64_t(a / b);
+        }
+        else
+        {
+            return exp;
+        }
+
+        if (!wide)
+        {
+            return Exp(int64_t{int32_t(uint32_t(result))});
+        }
+
+        // Smaller results would be emitted as `number`.
+        if (int64_t(result) <= INT32_MAX)
+        {
+            return exp;
+        }
+        return Exp(int64_t(result));
+    }
+
+    /**
+     * The literal a top-level `(var decl init)` binds, converted to the
+     * declared type; false if `init` is not a literal of that type.
+     */
+    bool constantValue(const Exp &decl, const Exp &init, Exp &value)
+    {
+        auto initTy = literalType(init);
+        if (initTy.empty() || initTy == "string")
+        {
+            return false;
+        }
+
+        auto declTy = decl.type == ExpType::LIST ? decl.list[1].string : initTy;
+
+        if (declTy == "f64" && init.type == ExpType::NUMBER)
+        {
+            value = floatExp(init.number);
+            return true;
+        }
+        if (declTy != initTy)
+        {
+            return false;
+        }
+
+        value = init;
+        return true;
+    }
+
+    /**
+     * The type codegen gives a literal, or "" if `exp` is not one.
+     */
+    std::string literalType(const Exp &exp)
+    {
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+            return exp.number > INT32_MAX ? "i64" : "number";
+        case ExpType::FLOAT:
+            return "f64";
+        case ExpType::STRING:
+            return "string";
+        case ExpType::SYMBOL:
+            return exp.string == "true" || exp.string == "false" ? "boolean" : "";
+        default:
+            return "";
+        }
+    }
+
+    bool isOperator(const std::string &op)
+    {
+        return op == "+" || op == "-" || op == "*" || op == "/" || op == ">" || op == "<" ||
+               op == "==" || op == "!=" || op == ">=" || op == "<=";
+    }
+
+    bool isNumber(const Exp &exp)
+    {
+        return exp.type == ExpType::NUMBER || exp.type == ExpType::FLOAT;
+    }
+
+    bool isBoolean(const Exp &exp, bool value)
+    {
+        return exp.type == ExpType::SYMBOL && exp.string == (value ? "true" : "false");
+    }
+
+    bool isTagged(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    double toDouble(const Exp &exp)
+    {
+        return exp.type == ExpType::FLOAT ? exp.floatNumber : double(exp.number);
+    }
+
+    Exp floatExp(double value)
+    {
+        Exp exp(int64_t{0});
+        exp.type = ExpType::FLOAT;
+        exp.floatNumber = value;
+        return exp;
+    }
+
+    Exp boolExp(bool value)
+    {
+        std::string name = value ? "true" : "false";
+        return Exp(name);
+    }
+
+    std::set<std::string> assigned_;
+
+    std::map<std::string, Exp> constants_;
+};
+
+#endif
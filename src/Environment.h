@@ -14,6 +14,13 @@ public:
     Environment(std::map<std::string, llvm::Value *> record,
                 std::shared_ptr<Environment> parent) : record_(record), parent_(parent)
     {
+        count()++;
+    }
+
+    static size_t &count()
+    {
+        static size_t scopes = 0;
+        return scopes;
     }
 
     llvm::Value* define(const std::string& name, llvm::Value* value){
@@ -21,6 +28,10 @@ public:
         return value;
     }
 
+    bool isDefined(const std::string& name){
+        return record_.count(name) != 0 || (parent_ != nullptr && parent_->isDefined(name));
+    }
+
     llvm::Value* lookup(const std::string& name){
         return resolve(name)->record_[name];
     }
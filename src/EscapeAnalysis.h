@@ -0,0 +1,327 @@
+#ifndef EscapeAnalysis_h
+#define EscapeAnalysis_h
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "./ClassHierarchy.h"
+#include "./parser/EvaParser.h"
+
+/**
+ * AST escape analysis for instances bound by `(var x (new ...))`.
+ *
+ * A name escapes unless every use of it is one of:
+ *
+ *   (prop x field)
+ *   (set (prop x field) value)   ; x as the target object only
+ *   (method x name)
+ *   an argument to printf, or to functions / methods whose
+ *   corresponding parameter does not escape
+ *
+ * Functions and methods are summarized per parameter, so instances can
+ * be passed to helpers and methods (including as `self`) and still be
+ * considered local. Constructors may return `self`: createInstance
+ * ignores their result.
+ */
+class EscapeAnalysis
+{
+public:
+    EscapeAnalysis(ClassHierarchy &classHierarchy) : classHierarchy_(classHierarchy) {}
+
+    void collect(const Exp &exp, const std::string &className = "")
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        if (isTagged(exp, "class") && exp.list.size() == 4)
+        {
+            for (const auto &member : exp.list[3].list)
+            {
+                collect(member, exp.list[1].string);
+            }
+            return;
+        }
+
+        if (isTagged(exp, "def"))
+        {
+            auto fnName = className.empty() ? exp.list[1].string
+                                            : className + "_" + exp.list[1].string;
+            functions_[fnName] = {&exp, className};
+            return;
+        }
+
+        for (const auto &child : exp.list)
+        {
+            collect(child, className);
+        }
+    }
+
+    /**
+     * Whether the instance of `className` bound to `name` may outlive
+     * the function whose body is `fnBody`.
+     */
+    bool escapes(const Exp &fnBody, const std::string &name, const std::string &className)
+    {
+        if (paramEscapes(className + "_constructor", 0))
+        {
+            return true;
+        }
+
+        return escapesIn(fnBody, {name, className, true}, true, false);
+    }
+
+    /**
+     * Whether the closure bound to `name` may outlive the function
+     * whose body is `fnBody`: it may only be called.
+     */
+    bool closureEscapes(const Exp &fnBody, const std::string &name)
+    {
+        return escapesIn(fnBody, {name, "", false, true}, true, false);
+    }
+
+private:
+    struct FunctionInfo
+    {
+        const Exp *exp;
+        std::string className;
+    };
+
+    /**
+     * The tracked reference; `exact` when its dynamic class is known
+     * (a fresh instance) rather than an upper bound (`self`).
+     */
+    struct Tracked
+    {
+        std::string name;
+        std::string className;
+        bool exact;
+        bool callable = false;
+    };
+
+    bool isTagged(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    bool mentions(const Exp &exp, const std::string &name)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return exp.string == name;
+        }
+        for (const auto &child : exp.list)
+        {
+            if (mentions(child, name))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool isName(const Exp &exp, const Tracked &tracked)
+    {
+        return exp.type == ExpType::SYMBOL && exp.string == tracked.name;
+    }
+
+    std::string paramName(const Exp &param)
+    {
+        return param.type == ExpType::LIST ? param.list[0].string : param.string;
+    }
+
+    bool paramEscapes(const std::string &fnName, size_t paramIdx)
+    {
+        auto key = fnName + "#" + std::to_string(paramIdx);
+
+        auto summary = summaries_.find(key);
+        if (summary != summaries_.end())
+        {
+            return summary->second;
+        }
+
+        auto fn = functions_.find(fnName);
+        if (fn == functions_.end() || paramIdx >= fn->second.exp->list[2].list.size())
+        {
+            return summaries_[key] = true;
+        }
+
+        // Recursive calls see the parameter as escaping.
+        summaries_[key] = true;
+
+        auto &fnExp = *fn->second.exp;
+        auto &body = fnExp.list.size() > 5 ? fnExp.list[5] : fnExp.list[3];
+        auto name = paramName(fnExp.list[2].list[paramIdx]);
+        auto className = name == "self" ? fn->second.className : "";
+        auto isCtor = !className.empty() && fnExp.list[1].string == "constructor";
+
+        return summaries_[key] = escapesIn(body, {name, className, false}, true, isCtor);
+    }
+
+    bool escapesIn(const Exp &exp, const Tracked &tracked, bool isReturn, bool allowReturn)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return isName(exp, tracked) && !(isReturn && allowReturn);
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return false;
+        }
+
+        if (isTagged(exp, "def") || isTagged(exp, "class"))
+        {
+            return false;
+        }
+
+        // Captured into a closure record.
+        if (isTagged(exp, "lambda"))
+        {
+            return mentions(exp, tracked.name);
+        }
+
+        if (isTagged(exp, "begin") || isTagged(exp, "with-arena"))
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                if (escapesIn(exp.list[i], tracked, isReturn && i == exp.list.size() - 1, allowReturn))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        if (isTagged(exp, "if"))
+        {
+            return escapesIn(exp.list[1], tracked, false, allowReturn) ||
+                   escapesIn(exp.list[2], tracked, isReturn, allowReturn) ||
+                   escapesIn(exp.list[3], tracked, isReturn, allowReturn);
+        }
+
+        if (isTagged(exp, "prop") || isTagged(exp, "method"))
+        {
+            return !isName(exp.list[1], tracked) && escapesIn(exp.list[1], tracked, false, allowReturn);
+        }
+
+        if (isTagged(exp, "set") && isTagged(exp.list[1], "prop"))
+        {
+            return escapesIn(exp.list[1], tracked, false, allowReturn) ||
+                   escapesIn(exp.list[2], tracked, false, allowReturn);
+        }
+
+        if (isTagged(exp, "var"))
+        {
+            return escapesIn(exp.list[2], tracked, false, allowReturn);
+        }
+
+        std::set<std::string> callees;
+        auto calleesKnown = isTagged(exp, "printf") || resolveCallees(exp.list[0], tracked, callees);
+
+        auto callsTracked = tracked.callable && isName(exp.list[0], tracked);
+        if (!isTagged(exp, "printf") && !callsTracked && escapesIn(exp.list[0], tracked, false, allowReturn))
+        {
+            return true;
+        }
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            if (!isName(exp.list[i], tracked))
+            {
+                if (escapesIn(exp.list[i], tracked, false, allowReturn))
+                {
+                    return true;
+                }
+                continue;
+            }
+
+            if (!calleesKnown)
+            {
+                return true;
+            }
+            for (const auto &callee : callees)
+            {
+                if (paramEscapes(callee, i - 1))
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Every function a call through `tag` may reach; false if unknown.
+     */
+    bool resolveCallees(const Exp &tag, const Tracked &tracked, std::set<std::string> &callees)
+    {
+        if (tag.type == ExpType::SYMBOL)
+        {
+            if (functions_.count(tag.string) == 0)
+            {
+                return false;
+            }
+            callees.insert(tag.string);
+            return true;
+        }
+
+        if (!isTagged(tag, "method"))
+        {
+            return false;
+        }
+
+        auto methodName = tag.list[2].string;
+
+        if (isTagged(tag.list[1], "super"))
+        {
+            auto parentName = classHierarchy_.parentOf(tag.list[1].list[1].string);
+            auto impl = classHierarchy_.resolve(parentName, methodName);
+            if (impl.empty())
+            {
+                return false;
+            }
+            callees.insert(impl + "_" + methodName);
+            return true;
+        }
+
+        if (!isName(tag.list[1], tracked) || tracked.className.empty())
+        {
+            return false;
+        }
+
+        if (tracked.exact)
+        {
+            auto impl = classHierarchy_.resolve(tracked.className, methodName);
+            if (impl.empty())
+            {
+                return false;
+            }
+            callees.insert(impl + "_" + methodName);
+            return true;
+        }
+
+        if (!classHierarchy_.isClosedWorld())
+        {
+            return false;
+        }
+
+        for (const auto &impl : classHierarchy_.implementations(tracked.className, methodName))
+        {
+            callees.insert(impl + "_" + methodName);
+        }
+        return !callees.empty();
+    }
+
+    ClassHierarchy &classHierarchy_;
+
+    std::map<std::string, FunctionInfo> functions_;
+
+    std::map<std::string, bool> summaries_;
+};
+
+#endif
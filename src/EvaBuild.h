@@ -0,0 +1,112 @@
+#ifndef EvaBuild_h
+#define EvaBuild_h
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+#include "./EvaLLVM.h"
+#include "./Logger.h"
+#include "./ModuleGraph.h"
+
+/**
+ * Separate compilation: every file of a program is compiled to its own
+ * object in the build directory, named by its module key. A file is
+ * only recompiled when it, or something it imports, changed since the
+ * last build; the objects are then linked as usual.
+ */
+class EvaBuild
+{
+public:
+    EvaBuild(const CompileOptions &options, const std::string &buildDir)
+        : options_(options), buildDir_(buildDir) {}
+
+    /**
+     * Brings the objects for the program rooted at `mainPath` up to
+     * date, and returns their paths in link order.
+     */
+    std::vector<std::string> build(const std::string &mainPath, const std::string &source)
+    {
+        if (auto errorCode = llvm::sys::fs::create_directories(buildDir_))
+        {
+            DIE << "[EvaBuild]: cannot create " << buildDir_ << ": " << errorCode.message();
+        }
+
+        syntax::EvaParser parser;
+        ModuleGraph graph(parser);
+        graph.load(mainPath, source);
+        graph.computeKeys(salt());
+
+        auto &modules = graph.modules();
+        std::vector<std::string> objects;
+
+        for (size_t i = 0; i < modules.size(); i++)
+        {
+            auto objectFile = objectPath(modules[i]);
+            objects.push_back(objectFile);
+
+            if (llvm::sys::fs::exists(objectFile))
+            {
+                continue;
+            }
+
+            std::cerr << "[EvaBuild]: compiling " << modules[i].path << std::endl;
+
+            std::vector<const Exp *> imports;
+            for (auto dep : graph.dependencies(i))
+            {
+                imports.push_back(&modules[dep].ast);
+            }
+
+            auto moduleOptions = options_;
+            moduleOptions.separate = true;
+            moduleOptions.library = i != modules.size() - 1;
+
+            EvaLLVM vm(moduleOptions);
+            vm.compileModule(modules[i].ast, imports, objectFile);
+        }
+
+        return objects;
+    }
+
+private:
+    /**
+     * What besides the sources goes into the generated code: the
+     * compiler itself and the options that change it.
+     */
+    std::string salt()
+    {
+        std::string salt = std::string(__DATE__ " " __TIME__) + '\0' + options_.gc;
+
+        if (!options_.fieldProfile.empty())
+        {
+            std::ifstream profileFile(options_.fieldProfile);
+            std::stringstream buffer;
+            buffer << profileFile.rdbuf();
+            salt += '\0' + buffer.str();
+        }
+
+        return salt;
+    }
+
+    std::string objectPath(const ModuleInfo &module)
+    {
+        std::stringstream name;
+        name << llvm::sys::path::stem(module.path).str() << "-" << std::hex << module.key << ".o";
+
+        llvm::SmallString<256> path(buildDir_);
+        llvm::sys::path::append(path, name.str());
+        return path.str().str();
+    }
+
+    CompileOptions options_;
+
+    std::string buildDir_;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef EvaJIT_h
+#define EvaJIT_h
+
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "./Logger.h"
+
+/**
+ * Writes /tmp/perf-<pid>.map entries for every function the JIT emits,
+ * so `perf report` can attribute samples to Eva function names.
+ */
+class PerfMapListener : public llvm::JITEventListener
+{
+public:
+    PerfMapListener()
+    {
+        auto fileName = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        std::error_code errorCode;
+        perfMap_ = std::make_unique<llvm::raw_fd_ostream>(fileName, errorCode,
+                                                           llvm::sys::fs::OF_Append);
+        if (errorCode)
+        {
+            DIE << "[EvaJIT]: cannot open " << fileName << ": " << errorCode.message();
+        }
+    }
+
+    void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile &obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &info) override
+    {
+        auto debugObj = info.getObjectForDebug(obj);
+        auto &loadedObj = debugObj.getBinary() != nullptr ? *debugObj.getBinary() : obj;
+
+        for (const auto &symbolSize : llvm::object::computeSymbolSizes(loadedObj))
+        {
+            auto symbol = symbolSize.first;
+
+            auto type = symbol.getType();
+            if (!type || *type != llvm::object::SymbolRef::ST_Function)
+            {
+                llvm::consumeError(type.takeError());
+                continue;
+            }
+
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+            if (!name || !address)
+            {
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(address.takeError());
+                continue;
+            }
+
+            *perfMap_ << llvm::format_hex_no_prefix(*address, 1) << " "
+                      << llvm::format_hex_no_prefix(symbolSize.second, 1) << " "
+                      << *name << "\n";
+        }
+
+        perfMap_->flush();
+    }
+
+private:
+    std::unique_ptr<llvm::raw_fd_ostream> perfMap_;
+};
+
+/**
+ * In-process execution of a compiled Eva module. With `profile`, emitted
+ * functions are reported to perf through a perf map and a jitdump.
+ */
+class EvaJIT
+{
+public:
+    EvaJIT(bool profile = true)
+    {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+
+        if (profile)
+        {
+            perfMap_ = std::make_unique<PerfMapListener>();
+            perfJitDump_ = llvm::JITEventListener::createPerfJITEventListener();
+        }
+
+        auto jit = llvm::orc::LLJITBuilder()
+                       .setObjectLinkingLayerCreator(
+                           [this](llvm::orc::ExecutionSession &es, const llvm::Triple &)
+                           {
+                               auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                                   es, []()
+                                   { return std::make_unique<llvm::SectionMemoryManager>(); });
+                               if (perfMap_ != nullptr)
+                               {
+                                   layer->registerJITEventListener(*perfMap_);
+                               }
+                               if (perfJitDump_ != nullptr)
+                               {
+                                   layer->registerJITEventListener(*perfJitDump_);
+                               }
+                               return layer;
+                           })
+                       .create();
+
+        if (!jit)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(jit.takeError());
+        }
+        jit_ = std::move(*jit);
+
+        auto globalPrefix = jit_->getDataLayout().getGlobalPrefix();
+        addGenerator(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(globalPrefix));
+
+        // Boehm GC is only required by programs that allocate instances;
+        // a missing library surfaces later as an unresolved GC_malloc.
+        auto gcLib = llvm::orc::DynamicLibrarySearchGenerator::Load("libgc.so.1", globalPrefix);
+        if (gcLib)
+        {
+            addGenerator(std::move(gcLib));
+        }
+        else
+        {
+            llvm::consumeError(gcLib.takeError());
+        }
+    }
+
+    int run(std::unique_ptr<llvm::Module> module, std::unique_ptr<llvm::LLVMContext> ctx)
+    {
+        module->setDataLayout(jit_->getDataLayout());
+
+        auto err = jit_->addIRModule(
+            llvm::orc::ThreadSafeModule(std::move(module), std::move(ctx)));
+        if (err)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(std::move(err));
+        }
+
+        // Runs llvm.global_ctors (GC descriptor setup).
+        err = jit_->initialize(jit_->getMainJITDylib());
+        if (err)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(std::move(err));
+        }
+
+        auto mainSym = jit_->lookup("main");
+        if (!mainSym)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(mainSym.takeError());
+        }
+
+        auto mainFn = llvm::jitTargetAddressToFunction<int (*)()>(mainSym->getAddress());
+        return mainFn();
+    }
+
+    /**
+     * Address of a symbol defined by the module passed to run().
+     */
+    void *lookup(const std::string &name)
+    {
+        auto symbol = jit_->lookup(name);
+        if (!symbol)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(symbol.takeError());
+        }
+        return llvm::jitTargetAddressToPointer<void *>(symbol->getAddress());
+    }
+
+private:
+    void addGenerator(llvm::Expected<std::unique_ptr<llvm::orc::DynamicLibrarySearchGenerator>> generator)
+    {
+        if (!generator)
+        {
+            DIE << "[EvaJIT]: " << llvm::toString(generator.takeError());
+        }
+        jit_->getMainJITDylib().addGenerator(std::move(*generator));
+    }
+
+    std::unique_ptr<PerfMapListener> perfMap_;
+
+    llvm::JITEventListener *perfJitDump_ = nullptr;
+
+    std::unique_ptr<llvm::orc::LLJIT> jit_;
+};
+
+#endif
@@ -1,71 +1,308 @@
 #ifndef EvaLLVM_h
 #define EvaLLVM_h
 
+#include <algorithm>
+#include <cctype>
+#include <list>
 #include <string>
 #include <memory>
+#include <set>
+#include <unordered_map>
+#include <fstream>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Scalar/RewriteStatepointsForGC.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <llvm/Transforms/Instrumentation.h>
+#include <llvm/Transforms/Instrumentation/InstrProfiling.h>
+#include <llvm/Transforms/Instrumentation/PGOInstrumentation.h>
 #include <iostream>
 #include <errno.h>
 
+#include "./ClassHierarchy.h"
+#include "./ConstantFolder.h"
 #include "./Environment.h"
+#include "./EscapeAnalysis.h"
+#include "./EvaJIT.h"
+#include "./Instrumentation.h"
+#include "./MemReport.h"
+#include "./ModuleGraph.h"
+#include "./Reachability.h"
 #include "./parser/EvaParser.h"
 
 using syntax::EvaParser;
 using Env = std::shared_ptr<Environment>;
 
+/**
+ * Class metadata, computed once when the class is compiled: hashed
+ * field and method slots, and direct pointers to everything `new`,
+ * `prop` and `method` need.
+ *
+ * Slots are stable across the hierarchy: a class's fields and methods
+ * start with its parent's, in the parent's order. Only methods that are
+ * dispatched somewhere get a slot, and `methods` holds nullptr for
+ * unreachable ones.
+ */
 struct ClassInfo
 {
-    llvm::StructType *cls;
-    llvm::StructType *parent;
-    std::map<std::string, llvm::Type *> fieldsMap;
-    std::map<std::string, llvm::Function *> methodsMap;
+    std::string name;
+    llvm::StructType *cls = nullptr;
+    ClassInfo *parent = nullptr;
+
+    std::unordered_map<std::string, llvm::Type *> fieldTypes;
+    std::vector<std::string> declaredFields;
+    std::vector<std::string> fieldOrder;
+    std::unordered_map<std::string, unsigned> fieldSlots;
+
+    std::vector<std::string> methodOrder;
+    std::unordered_map<std::string, unsigned> methodSlots;
+    std::vector<llvm::Function *> methods;
+    std::vector<llvm::FunctionType *> methodTypes;
+
+    llvm::Function *constructor = nullptr;
+    llvm::StructType *vTableTy = nullptr;
+    llvm::GlobalVariable *vTable = nullptr;
+    llvm::MDNode *tbaaType = nullptr;
+};
+
+/**
+ * A `struct` value type: fields in declaration order, no vtable.
+ */
+struct StructInfo
+{
+    llvm::StructType *type;
+    std::vector<std::string> fieldNames;
+    std::vector<Exp> inits;
+};
+
+/**
+ * A `def` or `class` with type parameters, `name<T, U>`: instantiated
+ * by substituting concrete type names into its AST on first use.
+ */
+struct GenericInfo
+{
+    Exp exp;
+    std::vector<std::string> typeParams;
+    std::shared_ptr<Environment> env;
+};
+
+struct CompileOptions
+{
+    bool jit = false;
+    bool instrumentCounters = false;
+    bool instrumentAllocs = false;
+    bool memReport = false;
+    bool pgoGen = false;
+    std::string pgoUse;
+    bool instrumentFields = false;
+    std::string fieldProfile;
+    std::string gc = "boehm";
+    bool separate = false;
+    bool library = false;
 };
 
 static size_t VTABLE_INDEX = 0;
 
 static size_t RESERVED_FIELDS_COUNT = 1;
 
-#define GEN_BINARY_OP(Op, varName)             \
-    do                                         \
-    {                                          \
-        auto op1 = gen(exp.list[1], env);      \
-        auto op2 = gen(exp.list[2], env);      \
-        return builder->Op(op1, op2, varName); \
+/**
+ * Instances up to this size are allocated inline from thread-local
+ * buffers; larger ones call into the collector directly.
+ */
+static size_t SMALL_OBJECT_SIZE = 256;
+
+static size_t ATOMIC_CHUNK_SIZE = 4096;
+
+/**
+ * Bytes of instances a free list refill allocates at once.
+ */
+static size_t FREE_LIST_BATCH_SIZE = 4096;
+
+static size_t ARENA_CHUNK_SIZE = 64 * 1024;
+
+/**
+ * With --gc=statepoint object pointers live in this address space,
+ * which RewriteStatepointsForGC treats as GC-managed.
+ */
+static unsigned GC_ADDRESS_SPACE = 1;
+
+static const char *GC_STRATEGY = "statepoint-example";
+
+/**
+ * Object map flag for arrays, whose size depends on their length.
+ */
+static uint64_t ARRAY_MAP = uint64_t{1} << 63;
+
+#define GEN_BINARY_OP(IntOp, FloatOp, varName)          \
+    do                                                  \
+    {                                                   \
+        auto op1 = gen(exp.list[1], env);               \
+        auto op2 = gen(exp.list[2], env);               \
+        promoteOperands(op1, op2);                      \
+        if (op1->getType()->isFloatingPointTy())        \
+        {                                               \
+            return builder->FloatOp(op1, op2, varName); \
+        }                                               \
+        return builder->IntOp(op1, op2, varName);       \
     } while (false);
 
 class EvaLLVM
 {
 public:
-    EvaLLVM() : parser(std::make_unique<EvaParser>())
+    EvaLLVM(const CompileOptions &options = {})
+        : options(options), parser(std::make_unique<EvaParser>())
     {
         moduleInit();
         setupExternFunctions();
         setupGlobalEnvironment();
         setupTargetTriple();
+        setupInstrumentation();
+        loadFieldProfile();
     }
 
-    void exec(const std::string &program)
+    /**
+     * Compiles `program`, read from `path`, together with the files it
+     * imports as one module.
+     */
+    int exec(const std::string &program, const std::string &path = "")
     {
-        auto ast = parser->parse("(begin " + program + ")");
+        ModuleGraph graph(*parser);
+        graph.load(path, program);
+        auto ast = graph.program();
+        memPhase("parse");
+
+        ast = ConstantFolder().fold(ast);
+        memPhase("fold");
+
         compile(ast);
+        memPhase("codegen");
+
+        llvm::verifyModule(*module, &llvm::errs());
+        memPhase("verify");
+
+        if (options.pgoGen || !options.pgoUse.empty())
+        {
+            runProfilePasses();
+        }
+
+        if (isPreciseGC())
+        {
+            runStatepointPasses();
+        }
+
         module->print(llvm::outs(), nullptr);
         std::cout << "\n";
         saveModuleToFile("./out.ll");
+        memPhase("emit");
+
+        if (options.memReport)
+        {
+            reportMemStats(ast);
+        }
+
+        if (options.jit)
+        {
+            EvaJIT jit;
+            return jit.run(std::move(module), std::move(ctx));
+        }
+
+        return 0;
+    }
+
+    /**
+     * Compiles one module of a separately compiled program to
+     * `objectFile`. `imports` are the modules it depends on, in
+     * dependency order: their definitions are only declared, and their
+     * constant vars are visible as if defined in this module.
+     */
+    void compileModule(const Exp &program, const std::vector<const Exp *> &imports,
+                       const std::string &objectFile)
+    {
+        imports_ = imports;
+        classHierarchy_.setClosedWorld(!options.library);
+
+        std::vector<Exp> forms{program.list[0]};
+        for (auto imported : imports)
+        {
+            for (auto i = 1; i < imported->list.size(); i++)
+            {
+                if (isVar(imported->list[i]))
+                {
+                    forms.push_back(imported->list[i]);
+                }
+            }
+        }
+        forms.insert(forms.end(), program.list.begin() + 1, program.list.end());
+
+        auto ast = ConstantFolder().fold(Exp(forms));
+        compile(ast);
+
+        if (llvm::verifyModule(*module, &llvm::errs()))
+        {
+            DIE << "[EvaLLVM]: invalid module " << objectFile;
+        }
+
+        emitObject(objectFile);
     }
 
     ~EvaLLVM() = default;
 
 private:
+    CompileOptions options;
+
     std::unique_ptr<EvaParser> parser;
 
     std::shared_ptr<Environment> GlobalEnv;
 
     llvm::StructType *cls = nullptr;
 
-    std::map<std::string, ClassInfo> classMap_;
+    std::unordered_map<std::string, ClassInfo> classMap_;
+
+    std::unordered_map<llvm::StructType *, ClassInfo *> classInfoByType_;
+
+    std::map<std::string, StructInfo> structMap_;
+
+    ClassHierarchy classHierarchy_;
+
+    EscapeAnalysis escapeAnalysis_{classHierarchy_};
+
+    Reachability reachability_{classHierarchy_};
+
+    const Exp *fnBody_ = nullptr;
+
+    std::set<const Exp *> tailCalls_;
+
+    std::set<llvm::AllocaInst *> stackObjects_;
+
+    /**
+     * Variables captured by the lambda being compiled.
+     */
+    std::set<std::string> captures_;
+
+    size_t lambdaCount_ = 0;
+
+    std::map<std::string, GenericInfo> genericFunctions_;
+
+    std::map<std::string, GenericInfo> genericClasses_;
+
+    /**
+     * Instantiated ASTs of generic functions and classes.
+     */
+    std::list<Exp> instances_;
+
+    std::map<std::string, uint64_t> fieldProfile_;
+
+    llvm::MDNode *tbaaRoot_ = nullptr;
 
     llvm::Function *fn;
 
@@ -77,20 +314,141 @@ private:
 
     std::unique_ptr<llvm::IRBuilder<>> builder;
 
+    std::unique_ptr<Instrumentation> instrumentation;
+
+    size_t loopCount_ = 0;
+
+    /**
+     * Nesting of `with-arena` blocks around the code being generated
+     * in the current function.
+     */
+    size_t arenaDepth_ = 0;
+
+    bool usesArenas_ = false;
+
+    const Exp *program_ = nullptr;
+
+    /**
+     * Index of the top-level form being compiled in `program_`.
+     */
+    size_t topLevelIndex_ = 0;
+
+    /**
+     * Set on the compiler that runs `comptime` expressions, which
+     * compiles them as ordinary code.
+     */
+    bool evaluating_ = false;
+
+    /**
+     * Modules this one imports, when compiled separately.
+     */
+    std::vector<const Exp *> imports_;
+
+    /**
+     * Set while declaring the definitions of imported modules.
+     */
+    bool declaring_ = false;
+
     void compile(const Exp &ast)
     {
-        fn = createFunction("main", llvm::FunctionType::get(builder->getInt32Ty(), false), GlobalEnv);
-        createGlobalVar("version", builder->getInt32(42));
-        gen(ast, GlobalEnv);
+        compileMain(ast);
+
+        if (instrumentation != nullptr)
+        {
+            instrumentation->finalize(*builder);
+        }
+
         builder->CreateRet(builder->getInt32(0));
     }
 
+    /**
+     * Compiles the top-level program into `main`. A library module has
+     * no top-level code to run and keeps it internal instead.
+     */
+    llvm::Value *compileMain(const Exp &ast)
+    {
+        auto mainName = options.library ? "__eva_module" : "main";
+        fn = createFunction(mainName, llvm::FunctionType::get(builder->getInt32Ty(), false), GlobalEnv);
+        auto version = createGlobalVar("version", builder->getInt32(42));
+        if (options.library)
+        {
+            fn->setLinkage(llvm::GlobalValue::InternalLinkage);
+            version->setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+
+        for (auto imported : imports_)
+        {
+            classHierarchy_.collect(*imported);
+            escapeAnalysis_.collect(*imported);
+        }
+        classHierarchy_.collect(ast);
+        escapeAnalysis_.collect(ast);
+        if (!options.separate)
+        {
+            reachability_.analyze(ast);
+        }
+
+        program_ = &ast;
+        fnBody_ = &ast;
+        usesArenas_ = containsTag(ast, "with-arena");
+
+        declareImports();
+        return gen(ast, GlobalEnv);
+    }
+
+    /**
+     * Declares what the imported modules define; their code is in their
+     * own objects. Generic templates are instantiated here as needed.
+     */
+    void declareImports()
+    {
+        declaring_ = true;
+
+        for (auto imported : imports_)
+        {
+            for (auto i = 1; i < imported->list.size(); i++)
+            {
+                auto &form = imported->list[i];
+                auto isGeneric = form.list.size() > 1 && isGenericName(form.list[1].string);
+
+                if (isDef(form) && isGeneric)
+                {
+                    declareGeneric(genericFunctions_, form, GlobalEnv);
+                }
+                else if (isDef(form))
+                {
+                    createFunctionProto(form.list[1].string, extractFcuntionType(form), GlobalEnv);
+                }
+                else if (isTaggedList(form, "class") && isGeneric)
+                {
+                    declareGeneric(genericClasses_, form, GlobalEnv);
+                }
+                else if (isTaggedList(form, "class"))
+                {
+                    compileClass(form, GlobalEnv);
+                }
+                else if (isTaggedList(form, "struct"))
+                {
+                    compileStruct(form);
+                }
+            }
+        }
+
+        declaring_ = false;
+    }
+
     llvm::Value *gen(const Exp &exp, Env env)
     {
         switch (exp.type)
         {
         case ExpType::NUMBER:
+            if (exp.number > INT32_MAX)
+            {
+                return builder->getInt64(exp.number);
+            }
             return builder->getInt32(exp.number);
+        case ExpType::FLOAT:
+            return llvm::ConstantFP::get(builder->getDoubleTy(), exp.floatNumber);
         case ExpType::STRING:
         {
             auto re = std::regex("\\\\n");
@@ -105,6 +463,12 @@ private:
             else
             {
                 auto varName = exp.string;
+
+                if (!env->isDefined(varName) && isGenericName(varName))
+                {
+                    return instantiateFunction(varName);
+                }
+
                 auto value = env->lookup(varName);
 
                 if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value))
@@ -135,43 +499,43 @@ private:
 
                 if (op == "+")
                 {
-                    GEN_BINARY_OP(CreateAdd, "tmpadd");
+                    GEN_BINARY_OP(CreateAdd, CreateFAdd, "tmpadd");
                 }
                 else if (op == "-")
                 {
-                    GEN_BINARY_OP(CreateSub, "tmpsub");
+                    GEN_BINARY_OP(CreateSub, CreateFSub, "tmpsub");
                 }
                 else if (op == "*")
                 {
-                    GEN_BINARY_OP(CreateMul, "tmpmul");
+                    GEN_BINARY_OP(CreateMul, CreateFMul, "tmpmul");
                 }
                 else if (op == "/")
                 {
-                    GEN_BINARY_OP(CreateSDiv, "tmpdiv");
+                    GEN_BINARY_OP(CreateSDiv, CreateFDiv, "tmpdiv");
                 }
                 else if (op == ">")
                 {
-                    GEN_BINARY_OP(CreateICmpUGT, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpSGT, CreateFCmpOGT, "tmpcmp");
                 }
                 else if (op == "<")
                 {
-                    GEN_BINARY_OP(CreateICmpULT, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpSLT, CreateFCmpOLT, "tmpcmp");
                 }
                 else if (op == "==")
                 {
-                    GEN_BINARY_OP(CreateICmpEQ, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpEQ, CreateFCmpOEQ, "tmpcmp");
                 }
                 else if (op == "!=")
                 {
-                    GEN_BINARY_OP(CreateICmpNE, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpNE, CreateFCmpUNE, "tmpcmp");
                 }
                 else if (op == ">=")
                 {
-                    GEN_BINARY_OP(CreateICmpUGE, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpSGE, CreateFCmpOGE, "tmpcmp");
                 }
                 else if (op == "<=")
                 {
-                    GEN_BINARY_OP(CreateICmpULE, "tmpcmp");
+                    GEN_BINARY_OP(CreateICmpSLE, CreateFCmpOLE, "tmpcmp");
                 }
 
                 else if (op == "if")
@@ -197,6 +561,15 @@ private:
                     builder->CreateBr(ifEndBlock);
                     elseBlock = builder->GetInsertBlock();
 
+                    if (thenRes->getType() != elseRes->getType())
+                    {
+                        auto resTy = getCommonType(thenRes->getType(), elseRes->getType());
+                        builder->SetInsertPoint(thenBlock->getTerminator());
+                        thenRes = castValue(thenRes, resTy);
+                        builder->SetInsertPoint(elseBlock->getTerminator());
+                        elseRes = castValue(elseRes, resTy);
+                    }
+
                     fn->getBasicBlockList().push_back(ifEndBlock);
                     builder->SetInsertPoint(ifEndBlock);
 
@@ -223,6 +596,13 @@ private:
                     fn->getBasicBlockList().push_back(bodyBlock);
                     builder->SetInsertPoint(bodyBlock);
                     gen(exp.list[2], env);
+
+                    if (options.instrumentCounters)
+                    {
+                        instrumentation->count(*builder, fn->getName().str() + ":while" +
+                                                             std::to_string(++loopCount_));
+                    }
+
                     builder->CreateBr(condBlock);
 
                     fn->getBasicBlockList().push_back(loopEndBlock);
@@ -231,8 +611,38 @@ private:
                     return builder->getInt32(0);
                 }
 
+                else if (op == "for")
+                {
+                    return genFor(exp, env);
+                }
+
+                else if (op == "lambda")
+                {
+                    return createClosure(exp, env, "");
+                }
+
+                else if (op == "import")
+                {
+                    // Resolved by ModuleGraph.
+                    return builder->getInt32(0);
+                }
+
+                else if (op == "comptime")
+                {
+                    return evaluating_ ? gen(exp.list[1], env) : genComptime(exp);
+                }
+
                 else if (op == "def")
                 {
+                    if (isGenericName(exp.list[1].string) && cls == nullptr)
+                    {
+                        declareGeneric(genericFunctions_, exp, env);
+                        return builder->getInt32(0);
+                    }
+                    if (!isLive(exp.list[1].string))
+                    {
+                        return builder->getInt32(0);
+                    }
                     return compileFunction(exp, exp.list[1].string, env);
                 }
 
@@ -246,44 +656,37 @@ private:
                     auto varNameDecl = exp.list[1];
                     auto varName = extractVarName(varNameDecl);
 
-                    if (isNew(exp.list[2]))
+                    if (isNew(exp.list[2]) && !isStructName(exp.list[2].list[1].string))
                     {
                         auto instance = createInstance(exp.list[2], env, varName);
-                        return env->define(varName, instance);
+
+                        auto varBinding = allocVar(varName, instance->getType(), env);
+                        builder->CreateStore(instance, varBinding);
+                        return instance;
+                    }
+
+                    if (isTaggedList(exp.list[2], "comptime"))
+                    {
+                        return genComptimeVar(exp, env);
                     }
 
-                    auto init = gen(exp.list[2], env);
+                    auto init = isTaggedList(exp.list[2], "lambda") ? createClosure(exp.list[2], env, varName)
+                                                                    : gen(exp.list[2], env);
 
-                    auto varTy = extractVarType(varNameDecl);
+                    auto varTy = varNameDecl.type == ExpType::LIST ? extractVarType(varNameDecl)
+                                                                   : init->getType();
                     auto varBinding = allocVar(varName, varTy, env);
-                    return builder->CreateStore(init, varBinding);
+                    return builder->CreateStore(castValue(init, varTy), varBinding);
                 }
                 else if (op == "set")
                 {
                     auto value = gen(exp.list[2], env);
-
-                    if (isProp(exp.list[1]))
-                    {
-                        auto instance = gen(exp.list[1].list[1], env);
-                        auto fieldName = exp.list[1].list[2].string;
-                        auto ptrName = std::string("p") + fieldName;
-
-                        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
-                        auto fieldIdx = getFieldIndex(cls, fieldName);
-                        auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
-                        builder->CreateStore(value, address);
-                        return value;
-                    }
-                    else
-                    {
-
-                        auto varName = exp.list[1].string;
-
-                        auto varBinding = env->lookup(varName);
-
-                        builder->CreateStore(value, varBinding);
-                        return value;
-                    }
+                    genAssign(exp.list[1], value, env);
+                    return value;
+                }
+                else if (op == "with-arena")
+                {
+                    return genWithArena(exp, env);
                 }
                 else if (op == "begin")
                 {
@@ -293,6 +696,14 @@ private:
                     llvm::Value *blockRes;
                     for (auto i = 1; i < exp.list.size(); i++)
                     {
+                        if (&exp == program_)
+                        {
+                            topLevelIndex_ = i;
+                        }
+                        if (isDef(exp.list[i]) && !isDef(exp.list[i - 1]))
+                        {
+                            declareFunctions(exp, i, blockEnv);
+                        }
                         blockRes = gen(exp.list[i], blockEnv);
                     }
                     return blockRes;
@@ -312,28 +723,20 @@ private:
 
                 else if (op == "class")
                 {
-                    auto name = exp.list[1].string;
-
-                    auto parent = exp.list[2].string == "null" ? nullptr
-                                                               : getClassByName(exp.list[2].string);
-
-                    cls = llvm::StructType::create(*ctx, name);
-
-                    if (parent != nullptr)
+                    if (isGenericName(exp.list[1].string))
                     {
-                        inheritClass(cls, parent);
+                        declareGeneric(genericClasses_, exp, env);
                     }
                     else
                     {
-                        classMap_[name] = {cls, parent, {}, {}};
+                        compileClass(exp, env);
                     }
+                    return builder->getInt32(0);
+                }
 
-                    buildClassInfo(cls, exp, env);
-
-                    gen(exp.list[3], env);
-
-                    cls = nullptr;
-
+                else if (op == "struct")
+                {
+                    compileStruct(exp);
                     return builder->getInt32(0);
                 }
 
@@ -348,51 +751,98 @@ private:
                     auto fieldName = exp.list[2].string;
                     auto ptrName = std::string("p") + fieldName;
 
+                    if (auto structTy = llvm::dyn_cast<llvm::StructType>(instance->getType()))
+                    {
+                        return builder->CreateExtractValue(
+                            instance, getStructFieldIndex(structTy, fieldName), fieldName);
+                    }
+
                     auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
                     auto fieldIdx = getFieldIndex(cls, fieldName);
+                    countFieldAccess(cls, fieldName);
                     auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
 
-                    return builder->CreateLoad(cls->getElementType(fieldIdx), address, fieldName);
+                    auto field = builder->CreateLoad(cls->getElementType(fieldIdx), address, fieldName);
+                    field->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAAccessTag(cls, fieldIdx));
+                    return field;
+                }
+
+                else if (op == "array")
+                {
+                    return createArray(exp, env);
+                }
+
+                else if (op == "index")
+                {
+                    auto array = gen(exp.list[1], env);
+                    auto address = getElementAddress(array, gen(exp.list[2], env));
+                    auto elemTy = getArrayElementType(array->getType());
+
+                    auto element = builder->CreateLoad(elemTy, address, "elem");
+                    element->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAElementTag(elemTy));
+                    return element;
+                }
+
+                else if (op == "len")
+                {
+                    auto array = gen(exp.list[1], env);
+                    auto arrayTy = getArrayStruct(array->getType());
+
+                    auto length = builder->CreateLoad(builder->getInt64Ty(),
+                                                      builder->CreateStructGEP(arrayTy, array, 0), "len");
+                    length->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAElementTag("array length"));
+                    return length;
                 }
 
                 else if (op == "method")
                 {
                     auto methodName = exp.list[2].string;
 
-                    llvm::StructType *cls;
-                    llvm::Value *vTable;
-                    llvm::StructType *vTableTy;
-
                     if (isSuper(exp.list[1]))
                     {
                         auto className = exp.list[1].list[1].string;
-                        cls = classMap_[className].parent;
-                        auto parentName = std::string{cls->getName().data()};
-                        vTable = module->getNamedGlobal(parentName + "_vTable");
-                        vTableTy = llvm::StructType::getTypeByName(*ctx, parentName + "_vTable");
+                        auto parent = getClassInfo(className).parent;
+                        if (parent == nullptr)
+                        {
+                            DIE << "[EvaLLVM]: class " << className << " has no parent";
+                        }
+                        return parent->methods[getMethodIndex(parent->cls, methodName)];
                     }
-                    else
-                    {
-                        auto instance = gen(exp.list[1], env);
-                        cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
 
-                        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
-                        vTable = builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
-                        vTableTy = (llvm::StructType *)(vTable->getType()->getContainedType(0));
+                    auto instance = gen(exp.list[1], env);
+                    auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+
+                    auto impl = classHierarchy_.uniqueImplementation(cls->getName().str(), methodName);
+                    if (!impl.empty() && module->getFunction(impl + "_" + methodName) != nullptr)
+                    {
+                        return module->getFunction(impl + "_" + methodName);
                     }
 
+                    auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+                    auto vTable = builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+                    vTable->setMetadata(llvm::LLVMContext::MD_invariant_group, llvm::MDNode::get(*ctx, {}));
+                    vTable->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAAccessTag(cls, VTABLE_INDEX));
+                    auto vTableTy = (llvm::StructType *)(vTable->getType()->getContainedType(0));
+
                     auto methodIdx = getMethodIndex(cls, methodName);
 
                     auto methodTy = (llvm::FunctionType *)vTableTy->getElementType(methodIdx);
 
                     auto methodAddr = builder->CreateStructGEP(vTableTy, vTable, methodIdx);
-                    return builder->CreateLoad(methodTy, methodAddr);
+                    auto method = builder->CreateLoad(methodTy, methodAddr);
+                    method->setMetadata(llvm::LLVMContext::MD_invariant_load, llvm::MDNode::get(*ctx, {}));
+                    return method;
                 }
 
                 else
                 {
                     auto callable = gen(exp.list[0], env);
 
+                    if (isClosureType(callable->getType()))
+                    {
+                        return genClosureCall(exp, callable, env);
+                    }
+
                     auto callableTy = callable->getType()->getContainedType(0);
 
                     std::vector<llvm::Value *> args{};
@@ -413,227 +863,2654 @@ private:
                     for (auto i = 1; i < exp.list.size(); i++, argIdx++)
                     {
                         auto argValue = gen(exp.list[i], env);
-                        auto paramTy = fn->getArg(argIdx)->getType();
-                        auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                        args.push_back(bitCastArgVal);
+                        args.push_back(castValue(argValue, fn->getArg(argIdx)->getType()));
                     }
 
-                    return builder->CreateCall(fn, args);
+                    return createCall(exp, fn->getFunctionType(), fn, args);
                 }
             }
 
             else
             {
-                auto loadMethod = (llvm::LoadInst *)gen(exp.list[0], env);
+                auto method = gen(exp.list[0], env);
+
+                if (isClosureType(method->getType()))
+                {
+                    return genClosureCall(exp, method, env);
+                }
 
-                auto fnTy = (llvm::FunctionType *)loadMethod->getPointerOperand()
-                                ->getType()
-                                ->getContainedType(0)
-                                ->getContainedType(0);
+                auto fnTy = (llvm::FunctionType *)method->getType()->getContainedType(0);
 
                 std::vector<llvm::Value *> args{};
 
                 for (auto i = 1; i < exp.list.size(); i++)
                 {
                     auto argValue = gen(exp.list[i], env);
-
-                    auto paramTy = fnTy->getParamType(i - 1);
-                    if (argValue->getType() != paramTy)
-                    {
-                        auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                        args.push_back(bitCastArgVal);
-                    }
-                    else
-                    {
-                        args.push_back(argValue);
-                    }
+                    args.push_back(castValue(argValue, fnTy->getParamType(i - 1)));
                 }
-                return builder->CreateCall(fnTy, loadMethod, args);
+                return createCall(exp, fnTy, method, args);
             }
         }
 
         return builder->getInt32(0);
     }
 
-    size_t getFieldIndex(llvm::StructType *cls, const std::string &fieldName)
+    /**
+     * Declares the run of adjacent defs starting at `block.list[first]`
+     * before compiling any of them, so they can call each other.
+     */
+    void declareFunctions(const Exp &block, size_t first, Env env)
     {
-        auto fields = &classMap_[cls->getName().data()].fieldsMap;
-        auto it = fields->find(fieldName);
-        return std::distance(fields->begin(), it) + RESERVED_FIELDS_COUNT;
+        if (cls != nullptr)
+        {
+            return;
+        }
+
+        for (auto i = first; i < block.list.size() && isDef(block.list[i]); i++)
+        {
+            auto &fnName = block.list[i].list[1].string;
+            if (module->getFunction(fnName) == nullptr && !isGenericName(fnName) && isLive(fnName))
+            {
+                createFunctionProto(fnName, extractFcuntionType(block.list[i]), env);
+            }
+        }
     }
 
-    size_t getMethodIndex(llvm::StructType *cls, const std::string &methodName)
+    /**
+     * Whether the def `name` being compiled, a method if inside a
+     * class, is reachable from the program.
+     */
+    bool isLive(const std::string &name)
     {
-        auto methods = &classMap_[cls->getName().data()].methodsMap;
-        auto it = methods->find(methodName);
-        return std::distance(methods->begin(), it);
+        if (cls != nullptr)
+        {
+            return reachability_.isMethodLive(cls->getName().str(), name);
+        }
+        return reachability_.isFunctionLive(name);
     }
 
-    llvm::Value *createInstance(const Exp &exp, Env env, const std::string &name)
+    /**
+     * Calls in tail position of a def body return right away. When the
+     * callee has the caller's signature (self and mutual recursion
+     * among same-typed functions) the call is `musttail`, which
+     * guarantees constant stack space; otherwise it is marked `tail`.
+     * With --gc=statepoint calls become statepoints, which cannot be
+     * musttail, and only self recursion is turned into a loop.
+     *
+     * The rest of the tail expression (if/begin merging, the final ret)
+     * is generated in an unreachable block and removed by the optimizer.
+     */
+    llvm::Value *createCall(const Exp &exp, llvm::FunctionType *fnTy, llvm::Value *callee,
+                            llvm::ArrayRef<llvm::Value *> args)
     {
-        auto className = exp.list[1].string;
-        auto cls = getClassByName(className);
+        auto call = builder->CreateCall(fnTy, callee, args);
 
-        if (cls == nullptr)
+        if (tailCalls_.count(&exp) == 0 || hasStackObjects() ||
+            fnTy->getReturnType() != fn->getReturnType())
         {
-            DIE << "[EvaLLVM]: unknown class " << cls;
+            return call;
         }
 
-        // auto instance = name.empty() ? builder->CreateAlloca(cls)
-        //                             : builder->CreateAlloca(cls, 0, name);
-        auto instance = mallocInstance(cls, name);
+        call->setTailCallKind(fnTy == fn->getFunctionType() && !isPreciseGC() ? llvm::CallInst::TCK_MustTail
+                                                                              : llvm::CallInst::TCK_Tail);
+        builder->CreateRet(call);
 
-        auto ctor = module->getFunction(className + "_constructor");
-        std::vector<llvm::Value *> args{instance};
-        for (auto i = 2; i < exp.list.size(); i++)
-        {
-            args.push_back(gen(exp.list[i], env));
-        }
-        builder->CreateCall(ctor, args);
-        return instance;
+        builder->SetInsertPoint(createBB("tailcall.cont", fn));
+        return llvm::UndefValue::get(call->getType());
     }
 
-    void buildClassInfo(llvm::StructType *cls, const Exp &clsExp, Env env)
+    /**
+     * Calls in tail position of `exp`: the expression itself, the last
+     * one of a begin, both branches of an if. Only call sites consult
+     * the set, so special forms recorded here are harmless.
+     */
+    void collectTailCalls(const Exp &exp)
     {
-        auto className = clsExp.list[1].string;
-        auto classInfo = &classMap_[className];
-
-        auto body = clsExp.list[3];
-
-        for (auto i = 1; i < body.list.size(); i++)
+        if (exp.type != ExpType::LIST || exp.list.empty())
         {
-            auto exp = body.list[i];
-
-            if (isVar(exp))
-            {
-                auto varNameDecl = exp.list[1];
+            return;
+        }
 
-                auto fieldName = extractVarName(varNameDecl);
-                auto fieldTy = extractVarType(varNameDecl);
+        if (isTaggedList(exp, "begin"))
+        {
+            collectTailCalls(exp.list.back());
+        }
+        else if (isTaggedList(exp, "if"))
+        {
+            collectTailCalls(exp.list[2]);
+            collectTailCalls(exp.list[3]);
+        }
+        else
+        {
+            tailCalls_.insert(&exp);
+        }
+    }
 
-                classInfo->fieldsMap[fieldName] = fieldTy;
-            }
-            else if (isDef(exp))
+    /**
+     * A tail call may not receive the caller's stack allocated
+     * instances or closure records, and escape analysis lets them be
+     * passed to callees.
+     */
+    bool hasStackObjects()
+    {
+        for (auto &inst : fn->getEntryBlock())
+        {
+            auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst);
+            if (alloca != nullptr && stackObjects_.count(alloca) != 0)
             {
-                auto methodName = exp.list[1].string;
-                auto fnName = className + "_" + methodName;
-
-                classInfo->methodsMap[methodName] =
-                    createFunctionProto(fnName, extractFcuntionType(exp), env);
+                return true;
             }
         }
-
-        buildClassBody(cls);
+        return false;
     }
 
-    void buildClassBody(llvm::StructType *cls)
+    /**
+     * IR-level PGO. Profile records are keyed by the LLVM function name,
+     * which for Eva functions is the source name (`fn`, `Class_method`),
+     * so a function keeps its profile as long as its own CFG is unchanged.
+     */
+    void runProfilePasses()
     {
-        std::string className{cls->getName().data()};
+        llvm::PassBuilder passBuilder;
 
-        auto classInfo = &classMap_[className];
+        llvm::LoopAnalysisManager lam;
+        llvm::FunctionAnalysisManager fam;
+        llvm::CGSCCAnalysisManager cgam;
+        llvm::ModuleAnalysisManager mam;
 
-        auto vTableName = className + "_vTable";
-        auto vTableTy = llvm::StructType::create(*ctx, vTableName);
+        passBuilder.registerModuleAnalyses(mam);
+        passBuilder.registerCGSCCAnalyses(cgam);
+        passBuilder.registerFunctionAnalyses(fam);
+        passBuilder.registerLoopAnalyses(lam);
+        passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
 
-        auto clsFields = std::vector<llvm::Type *>{
-            vTableTy->getPointerTo(),
-        };
-        for (const auto &fieldInfo : classInfo->fieldsMap)
+        llvm::ModulePassManager mpm;
+
+        if (options.pgoGen)
         {
-            clsFields.push_back(fieldInfo.second);
+            mpm.addPass(llvm::PGOInstrumentationGen());
+            llvm::InstrProfOptions profOptions;
+            profOptions.InstrProfileOutput = "default_%m.profraw";
+            mpm.addPass(llvm::InstrProfiling(profOptions));
+        }
+        else
+        {
+            mpm.addPass(llvm::PGOInstrumentationUse(options.pgoUse));
         }
 
-        cls->setBody(clsFields, false);
-
-        buildVTable(cls);
+        mpm.run(*module, mam);
     }
 
-    void buildVTable(llvm::StructType *cls)
+    /**
+     * Promotes variables to SSA (statepoints relocate values, not
+     * allocas) and rewrites every call that may collect into a
+     * gc.statepoint with its live object pointers.
+     */
+    void runStatepointPasses()
     {
-        std::string className{cls->getName().data()};
-        auto vTableName = className + "_vTable";
+        for (auto &function : *module)
+        {
+            if (function.isDeclaration() && function.getName() != "__eva_gc_alloc")
+            {
+                function.addFnAttr("gc-leaf-function");
+            }
+        }
+
+        llvm::PassBuilder passBuilder;
+
+        llvm::LoopAnalysisManager lam;
+        llvm::FunctionAnalysisManager fam;
+        llvm::CGSCCAnalysisManager cgam;
+        llvm::ModuleAnalysisManager mam;
+
+        passBuilder.registerModuleAnalyses(mam);
+        passBuilder.registerCGSCCAnalyses(cgam);
+        passBuilder.registerFunctionAnalyses(fam);
+        passBuilder.registerLoopAnalyses(lam);
+        passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
+
+        llvm::ModulePassManager mpm;
+        mpm.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::PromotePass()));
+        // Statepoints cannot be musttail: self recursion becomes a loop first.
+        mpm.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::TailCallElimPass()));
+        mpm.addPass(llvm::RewriteStatepointsForGC());
+        mpm.run(*module, mam);
+    }
+
+    bool isPreciseGC()
+    {
+        return options.gc == "statepoint";
+    }
+
+    unsigned objectAddressSpace()
+    {
+        return isPreciseGC() ? GC_ADDRESS_SPACE : 0;
+    }
+
+    void memPhase(const std::string &name)
+    {
+        if (options.memReport)
+        {
+            MemReport::get().phase(name);
+        }
+    }
+
+    void reportMemStats(const Exp &ast)
+    {
+        auto &report = MemReport::get();
+
+        size_t functions = 0, blocks = 0, instructions = 0, values = 0;
+        for (auto &function : *module)
+        {
+            functions++;
+            values += function.arg_size();
+            for (auto &block : function)
+            {
+                blocks++;
+                instructions += block.size();
+            }
+        }
+        values += functions + blocks + instructions + module->global_size();
+
+        report.stat("AST nodes", countExpNodes(ast));
+        report.stat("scopes", Environment::count());
+        report.stat("classes", classMap_.size());
+        report.stat("LLVM functions", functions);
+        report.stat("LLVM globals", module->global_size());
+        report.stat("LLVM basic blocks", blocks);
+        report.stat("LLVM instructions", instructions);
+        report.stat("LLVM values", values);
+        report.print();
+    }
+
+    size_t countExpNodes(const Exp &exp)
+    {
+        size_t count = 1;
+        for (const auto &child : exp.list)
+        {
+            count += countExpNodes(child);
+        }
+        return count;
+    }
+
+    ClassInfo &getClassInfo(llvm::StructType *cls)
+    {
+        auto it = classInfoByType_.find(cls);
+        if (it == classInfoByType_.end())
+        {
+            DIE << "[EvaLLVM]: " << cls->getName().str() << " is not a class";
+        }
+        return *it->second;
+    }
+
+    ClassInfo &getClassInfo(const std::string &className)
+    {
+        auto it = classMap_.find(className);
+        if (it == classMap_.end())
+        {
+            if (isGenericName(className))
+            {
+                instantiateClass(className);
+                return classMap_[className];
+            }
+            DIE << "[EvaLLVM]: unknown class " << className;
+        }
+        return it->second;
+    }
+
+    void compileClass(const Exp &exp, Env env)
+    {
+        auto name = exp.list[1].string;
+
+        if (classMap_.count(name) != 0 || isStructName(name))
+        {
+            DIE << "[EvaLLVM]: class " << name << " is already defined";
+        }
+
+        auto parent = exp.list[2].string == "null" ? nullptr
+                                                   : &getClassInfo(exp.list[2].string);
+
+        auto prevCls = cls;
+        cls = llvm::StructType::create(*ctx, name);
+
+        auto &classInfo = classMap_[name];
+        if (parent != nullptr)
+        {
+            inheritClass(classInfo, *parent);
+        }
+        classInfo.name = name;
+        classInfo.cls = cls;
+        classInfo.parent = parent;
+        classInfoByType_[cls] = &classInfo;
+
+        buildClassInfo(cls, exp, env);
+
+        if (!declaring_)
+        {
+            gen(exp.list[3], env);
+        }
+
+        cls = prevCls;
+    }
+
+    bool isGenericName(const std::string &name)
+    {
+        auto open = name.find('<');
+        return open != std::string::npos && open > 0 && name.back() == '>' &&
+               !isArrayTypeName(name) && !isClosureTypeName(name);
+    }
+
+    /**
+     * `name<A,B>` -> "name", {"A", "B"}; arguments may themselves be
+     * generic (`Box<Pair<number,f64>>`) or function types.
+     */
+    std::string splitGenericName(const std::string &name, std::vector<std::string> &typeArgs)
+    {
+        auto open = name.find('<');
+        auto args = name.substr(open + 1, name.size() - open - 2);
+
+        size_t start = 0;
+        int depth = 0;
+        for (size_t i = 0; i <= args.size(); i++)
+        {
+            if (i == args.size() || (args[i] == ',' && depth == 0))
+            {
+                typeArgs.push_back(args.substr(start, i - start));
+                start = i + 1;
+            }
+            else if (args.compare(i, 2, "->") == 0)
+            {
+                i++;
+            }
+            else if (args[i] == '<')
+            {
+                depth++;
+            }
+            else if (args[i] == '>')
+            {
+                depth--;
+            }
+        }
+
+        return name.substr(0, open);
+    }
+
+    void declareGeneric(std::map<std::string, GenericInfo> &generics, const Exp &exp, Env env)
+    {
+        std::vector<std::string> typeParams;
+        auto baseName = splitGenericName(exp.list[1].string, typeParams);
+
+        if (generics.count(baseName) != 0)
+        {
+            DIE << "[EvaLLVM]: generic " << baseName << " is already defined";
+        }
+
+        generics.insert({baseName, {exp, typeParams, env}});
+    }
+
+    /**
+     * The template's AST with its type parameters replaced by `name`'s
+     * type arguments. The compiler owns the result, since escape
+     * analysis keeps pointers into it.
+     */
+    const Exp &instantiateGeneric(std::map<std::string, GenericInfo> &generics, const std::string &name,
+                                  GenericInfo *&generic)
+    {
+        std::vector<std::string> typeArgs;
+        auto baseName = splitGenericName(name, typeArgs);
+
+        auto it = generics.find(baseName);
+        if (it == generics.end())
+        {
+            DIE << "[EvaLLVM]: " << baseName << " is not generic";
+        }
+        generic = &it->second;
+
+        if (typeArgs.size() != generic->typeParams.size())
+        {
+            DIE << "[EvaLLVM]: " << baseName << " takes " << generic->typeParams.size()
+                << " type arguments, got " << typeArgs.size();
+        }
+
+        std::map<std::string, std::string> bindings;
+        for (auto i = 0; i < typeArgs.size(); i++)
+        {
+            bindings[generic->typeParams[i]] = typeArgs[i];
+        }
+
+        instances_.push_back(substituteTypes(generic->exp, bindings));
+        return instances_.back();
+    }
+
+    llvm::Function *instantiateFunction(const std::string &name)
+    {
+        GenericInfo *generic;
+        auto &fnExp = instantiateGeneric(genericFunctions_, name, generic);
+        escapeAnalysis_.collect(fnExp);
+
+        auto prevCls = cls;
+        cls = nullptr;
+        auto fn = llvm::cast<llvm::Function>(compileFunction(fnExp, name, generic->env));
+        cls = prevCls;
+
+        // Every module using an instance compiles its own copy.
+        if (options.separate)
+        {
+            fn->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+        }
+
+        return fn;
+    }
+
+    void instantiateClass(const std::string &name)
+    {
+        GenericInfo *generic;
+        auto &classExp = instantiateGeneric(genericClasses_, name, generic);
+        classHierarchy_.instantiate(generic->exp.list[1].string, classExp);
+        escapeAnalysis_.collect(classExp);
+
+        auto prevBlock = builder->GetInsertBlock();
+        auto prevDeclaring = declaring_;
+        declaring_ = false;
+        compileClass(classExp, generic->env);
+        declaring_ = prevDeclaring;
+        builder->SetInsertPoint(prevBlock);
+
+        if (options.separate)
+        {
+            auto &classInfo = classMap_[name];
+            classInfo.vTable->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+            for (auto method : classInfo.methods)
+            {
+                if (method != nullptr && method->getName().startswith(name + "_"))
+                {
+                    method->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+                }
+            }
+        }
+    }
+
+    Exp substituteTypes(const Exp &exp, const std::map<std::string, std::string> &bindings)
+    {
+        auto result = exp;
+
+        if (exp.type == ExpType::SYMBOL)
+        {
+            result.string = substituteTypeName(exp.string, bindings);
+        }
+        else if (exp.type == ExpType::LIST)
+        {
+            for (auto &child : result.list)
+            {
+                child = substituteTypes(child, bindings);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * Replaces whole identifiers, so `T` in `array<T>`, `fn<T->T>` or
+     * `Box<T>` is substituted too.
+     */
+    std::string substituteTypeName(const std::string &name, const std::map<std::string, std::string> &bindings)
+    {
+        std::string result;
+        size_t i = 0;
+        while (i < name.size())
+        {
+            if (!std::isalnum(name[i]) && name[i] != '_')
+            {
+                result += name[i++];
+                continue;
+            }
+
+            auto start = i;
+            while (i < name.size() && (std::isalnum(name[i]) || name[i] == '_'))
+            {
+                i++;
+            }
+
+            auto word = name.substr(start, i - start);
+            auto binding = bindings.find(word);
+            result += binding != bindings.end() ? binding->second : word;
+        }
+        return result;
+    }
+
+    size_t getFieldIndex(llvm::StructType *cls, const std::string &fieldName)
+    {
+        auto &classInfo = getClassInfo(cls);
+        auto it = classInfo.fieldSlots.find(fieldName);
+        if (it == classInfo.fieldSlots.end())
+        {
+            DIE << "[EvaLLVM]: class " << classInfo.name << " has no field " << fieldName;
+        }
+        return it->second;
+    }
+
+    /**
+     * Class that declares `fieldName`: the root-most ancestor having it,
+     * since inherited fields keep the parent's slot.
+     */
+    std::string getFieldOwner(llvm::StructType *cls, const std::string &fieldName)
+    {
+        auto owner = &getClassInfo(cls);
+
+        while (owner->parent != nullptr && owner->parent->fieldSlots.count(fieldName) != 0)
+        {
+            owner = owner->parent;
+        }
+
+        return owner->name;
+    }
+
+    void countFieldAccess(llvm::StructType *cls, const std::string &fieldName)
+    {
+        if (options.instrumentFields)
+        {
+            instrumentation->count(*builder, getFieldOwner(cls, fieldName) + "." + fieldName);
+        }
+    }
+
+    size_t getMethodIndex(llvm::StructType *cls, const std::string &methodName)
+    {
+        auto &classInfo = getClassInfo(cls);
+        auto it = classInfo.methodSlots.find(methodName);
+        if (it == classInfo.methodSlots.end())
+        {
+            DIE << "[EvaLLVM]: class " << classInfo.name << " has no method " << methodName;
+        }
+        return it->second;
+    }
+
+    llvm::Value *createInstance(const Exp &exp, Env env, const std::string &name)
+    {
+        auto className = exp.list[1].string;
+
+        if (isStructName(className))
+        {
+            return createStructValue(exp, env);
+        }
+
+        auto &classInfo = getClassInfo(className);
+        auto cls = classInfo.cls;
+
+        if (classInfo.constructor == nullptr)
+        {
+            DIE << "[EvaLLVM]: class " << className << " does not define a constructor";
+        }
+
+        // The precise collector only knows heap objects.
+        auto isLocal = !name.empty() && !isPreciseGC() &&
+                       !escapeAnalysis_.escapes(*fnBody_, name, className);
+        auto instance = isLocal ? allocaInstance(cls, name) : mallocInstance(cls, name);
+
+        std::vector<llvm::Value *> args{instance};
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            args.push_back(castValue(gen(exp.list[i], env),
+                                     classInfo.constructor->getArg(args.size())->getType()));
+        }
+        builder->CreateCall(classInfo.constructor, args);
+        return instance;
+    }
+
+    /**
+     * (set name value), (set (prop object field) value)
+     *
+     * A field of a struct value is updated by rebuilding the value with
+     * insertvalue and assigning it back to where it came from.
+     */
+    void genAssign(const Exp &target, llvm::Value *value, Env env)
+    {
+        if (isTaggedList(target, "index"))
+        {
+            auto array = gen(target.list[1], env);
+            auto global = llvm::dyn_cast<llvm::GlobalVariable>(array->stripPointerCasts());
+            if (global != nullptr && global->isConstant())
+            {
+                DIE << "[EvaLLVM]: cannot assign elements of a comptime array";
+            }
+
+            auto elemTy = getArrayElementType(array->getType());
+            auto address = getElementAddress(array, gen(target.list[2], env));
+
+            value = castValue(value, elemTy);
+            auto store = builder->CreateStore(value, address);
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAElementTag(elemTy));
+
+            if (isPreciseGC() && isObjectPointer(value->getType()))
+            {
+                genWriteBarrier(array, value);
+            }
+            return;
+        }
+
+        if (!isProp(target))
+        {
+            if (captures_.count(target.string) != 0)
+            {
+                DIE << "[EvaLLVM]: cannot assign \"" << target.string
+                    << "\", which the lambda captures by value";
+            }
+
+            auto binding = env->lookup(target.string);
+            if (llvm::isa<llvm::Constant>(binding) && !llvm::isa<llvm::GlobalValue>(binding))
+            {
+                DIE << "[EvaLLVM]: cannot assign \"" << target.string << "\", which is a comptime constant";
+            }
+            if (!llvm::isa<llvm::AllocaInst>(binding) && !llvm::isa<llvm::GlobalVariable>(binding))
+            {
+                DIE << "[EvaLLVM]: cannot assign \"" << target.string << "\"";
+            }
+            auto bindingTy = llvm::isa<llvm::AllocaInst>(binding)
+                                 ? llvm::cast<llvm::AllocaInst>(binding)->getAllocatedType()
+                                 : llvm::cast<llvm::GlobalVariable>(binding)->getValueType();
+            builder->CreateStore(castValue(value, bindingTy), binding);
+            return;
+        }
+
+        auto instance = gen(target.list[1], env);
+        auto fieldName = target.list[2].string;
+        auto ptrName = std::string("p") + fieldName;
+
+        if (auto structTy = llvm::dyn_cast<llvm::StructType>(instance->getType()))
+        {
+            auto fieldIdx = getStructFieldIndex(structTy, fieldName);
+            auto updated = builder->CreateInsertValue(
+                instance, castValue(value, structTy->getElementType(fieldIdx)), fieldIdx);
+            genAssign(target.list[1], updated, env);
+            return;
+        }
+
+        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+        auto fieldIdx = getFieldIndex(cls, fieldName);
+        countFieldAccess(cls, fieldName);
+        auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+        value = castValue(value, cls->getElementType(fieldIdx));
+        auto store = builder->CreateStore(value, address);
+        store->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAAccessTag(cls, fieldIdx));
+
+        if (isPreciseGC() && isObjectPointer(value->getType()))
+        {
+            genWriteBarrier(instance, value);
+        }
+    }
+
+    void genWriteBarrier(llvm::Value *object, llvm::Value *value)
+    {
+        auto gcPtrTy = builder->getInt8Ty()->getPointerTo(GC_ADDRESS_SPACE);
+        builder->CreateCall(module->getFunction("__eva_gc_write_barrier"),
+                            {builder->CreatePointerCast(object, gcPtrTy),
+                             builder->CreatePointerCast(value, gcPtrTy)});
+    }
+
+    /**
+     * (lambda (params) [-> type] body)
+     *
+     * A flat closure { fn, env }: `fn` is the lambda lifted to an
+     * internal function taking the environment record as an extra
+     * first parameter, `env` holds copies of the captured locals, taken
+     * when the lambda is evaluated. Lambdas that capture nothing get a
+     * null record and no allocation. The record lives on the stack when
+     * the closure is bound by `var` and only ever called.
+     */
+    llvm::Value *createClosure(const Exp &exp, Env env, const std::string &name)
+    {
+        auto hasReturnType = exp.list.size() == 5 && exp.list[2].type == ExpType::SYMBOL &&
+                             exp.list[2].string == "->";
+
+        if ((exp.list.size() != 3 && !hasReturnType) || exp.list[1].type != ExpType::LIST)
+        {
+            DIE << "[EvaLLVM]: lambda takes a parameter list, an optional -> type and a body";
+        }
+
+        auto &params = exp.list[1];
+        auto &body = hasReturnType ? exp.list[4] : exp.list[2];
+
+        std::string typeName = "fn<";
+        std::set<std::string> bound;
+        for (auto i = 0; i < params.list.size(); i++)
+        {
+            auto &param = params.list[i];
+            typeName += (i > 0 ? "," : "") + (param.type == ExpType::LIST ? param.list[1].string : std::string("number"));
+            bound.insert(extractVarName(param));
+        }
+        typeName += "->" + (hasReturnType ? exp.list[3].string : std::string("number")) + ">";
+
+        std::vector<std::string> captures;
+        collectFreeVariables(body, bound, captures, env);
+
+        if (!captures.empty() && isPreciseGC())
+        {
+            DIE << "[EvaLLVM]: lambdas capturing variables are not supported with --gc=statepoint";
+        }
+
+        std::vector<llvm::Value *> captured;
+        std::vector<llvm::Type *> capturedTys;
+        for (auto captureName : captures)
+        {
+            captured.push_back(gen(Exp(captureName), env));
+            capturedTys.push_back(captured.back()->getType());
+        }
+
+        auto closureTy = getClosureType(typeName);
+        auto fnTy = llvm::cast<llvm::FunctionType>(closureTy->getElementType(0)->getPointerElementType());
+
+        auto lambdaName = fn->getName().str() + ".lambda" + std::to_string(++lambdaCount_);
+        auto recordTy = captures.empty() ? nullptr
+                                         : llvm::StructType::create(*ctx, capturedTys, lambdaName + ".env");
+
+        auto lambdaFn = compileLambda(lambdaName, fnTy, params, body, captures, recordTy, env);
+
+        llvm::Value *record = llvm::ConstantPointerNull::get(builder->getInt8PtrTy());
+        if (recordTy != nullptr)
+        {
+            llvm::Value *recordPtr;
+            if (!name.empty() && !escapeAnalysis_.closureEscapes(*fnBody_, name))
+            {
+                auto alloca = createEntryAlloca(recordTy, name + ".env");
+                stackObjects_.insert(alloca);
+                recordPtr = alloca;
+            }
+            else
+            {
+                std::vector<uint64_t> pointerOffsets;
+                collectPointerOffsets(recordTy, 0, false, pointerOffsets);
+
+                auto recordSize = builder->getInt64(getTypeSize(recordTy));
+                auto mallocPtr = builder->CreateCall(
+                    module->getFunction(pointerOffsets.empty() ? "GC_malloc_atomic" : "GC_malloc"),
+                    recordSize, lambdaName + ".env");
+
+                if (options.instrumentAllocs)
+                {
+                    instrumentation->countAllocation(*builder, recordTy->getName().str(), recordSize);
+                }
+
+                recordPtr = builder->CreatePointerCast(mallocPtr, recordTy->getPointerTo());
+            }
+
+            for (auto i = 0; i < captured.size(); i++)
+            {
+                builder->CreateStore(captured[i], builder->CreateStructGEP(recordTy, recordPtr, i));
+            }
+            record = builder->CreatePointerCast(recordPtr, builder->getInt8PtrTy());
+        }
+
+        llvm::Value *closure = llvm::UndefValue::get(closureTy);
+        closure = builder->CreateInsertValue(closure, lambdaFn, 0);
+        return builder->CreateInsertValue(closure, record, 1, "closure");
+    }
+
+    llvm::Function *compileLambda(const std::string &lambdaName, llvm::FunctionType *fnTy, const Exp &params,
+                                  const Exp &body, const std::vector<std::string> &captures,
+                                  llvm::StructType *recordTy, Env env)
+    {
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+        auto prevFnBody = fnBody_;
+        fnBody_ = &body;
+        auto prevArenaDepth = arenaDepth_;
+        arenaDepth_ = 0;
+        auto prevTailCalls = std::move(tailCalls_);
+        tailCalls_.clear();
+        collectTailCalls(body);
+        auto prevCaptures = std::move(captures_);
+        captures_ = std::set<std::string>(captures.begin(), captures.end());
+
+        fn = createFunction(lambdaName, fnTy, env);
+        fn->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+        auto lambdaEnv = std::make_shared<Environment>(
+            std::map<std::string, llvm::Value *>{}, env);
+
+        auto record = fn->getArg(0);
+        record->setName("env");
+
+        if (recordTy != nullptr)
+        {
+            auto recordPtr = builder->CreatePointerCast(record, recordTy->getPointerTo());
+            for (auto i = 0; i < captures.size(); i++)
+            {
+                auto value = builder->CreateLoad(recordTy->getElementType(i),
+                                                 builder->CreateStructGEP(recordTy, recordPtr, i), captures[i]);
+                builder->CreateStore(value, allocVar(captures[i], value->getType(), lambdaEnv));
+            }
+        }
+
+        for (auto i = 0; i < params.list.size(); i++)
+        {
+            auto arg = fn->getArg(i + 1);
+            auto argName = extractVarName(params.list[i]);
+            arg->setName(argName);
+            builder->CreateStore(arg, allocVar(argName, arg->getType(), lambdaEnv));
+        }
+
+        builder->CreateRet(castValue(gen(body, lambdaEnv), fn->getReturnType()));
+
+        auto lambdaFn = fn;
+        builder->SetInsertPoint(prevBlock);
+        fn = prevFn;
+        fnBody_ = prevFnBody;
+        tailCalls_ = std::move(prevTailCalls);
+        captures_ = std::move(prevCaptures);
+        arenaDepth_ = prevArenaDepth;
+        return lambdaFn;
+    }
+
+    /**
+     * Locals of the enclosing function that `exp` refers to, in order
+     * of first use. Globals and functions are reachable without
+     * capturing; names bound inside the lambda are skipped throughout.
+     */
+    void collectFreeVariables(const Exp &exp, std::set<std::string> &bound, std::vector<std::string> &free,
+                              Env env)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            if (bound.count(exp.string) != 0 || !env->isDefined(exp.string) ||
+                std::find(free.begin(), free.end(), exp.string) != free.end())
+            {
+                return;
+            }
+
+            auto value = env->lookup(exp.string);
+            if (llvm::isa<llvm::Instruction>(value) || llvm::isa<llvm::Argument>(value))
+            {
+                free.push_back(exp.string);
+            }
+            return;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty() || isDef(exp) ||
+            isTaggedList(exp, "class") || isTaggedList(exp, "struct"))
+        {
+            return;
+        }
+
+        if (isVar(exp) || isTaggedList(exp, "for"))
+        {
+            bound.insert(extractVarName(exp.list[1]));
+        }
+
+        if (isTaggedList(exp, "lambda"))
+        {
+            auto innerBound = bound;
+            for (const auto &param : exp.list[1].list)
+            {
+                innerBound.insert(extractVarName(param));
+            }
+            collectFreeVariables(exp.list.back(), innerBound, free, env);
+            return;
+        }
+
+        // Field, method, class and element type names are not variables.
+        auto skipSecond = isProp(exp) || isTaggedList(exp, "method");
+        auto skipFirst = isNew(exp) || isTaggedList(exp, "array") || isSuper(exp);
+
+        // The head is a callee (a local closure) or a special form name.
+        for (auto i = 0; i < exp.list.size(); i++)
+        {
+            if ((i == 1 && skipFirst) || (i == 2 && skipSecond))
+            {
+                continue;
+            }
+            collectFreeVariables(exp.list[i], bound, free, env);
+        }
+    }
+
+    llvm::Value *genClosureCall(const Exp &exp, llvm::Value *closure, Env env)
+    {
+        auto fnPtr = builder->CreateExtractValue(closure, 0, "closure.fn");
+        auto fnTy = llvm::cast<llvm::FunctionType>(fnPtr->getType()->getPointerElementType());
+
+        if (exp.list.size() != fnTy->getNumParams())
+        {
+            DIE << "[EvaLLVM]: closure expects " << fnTy->getNumParams() - 1 << " arguments";
+        }
+
+        std::vector<llvm::Value *> args{builder->CreateExtractValue(closure, 1, "closure.env")};
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            args.push_back(castValue(gen(exp.list[i], env), fnTy->getParamType(i)));
+        }
+
+        return createCall(exp, fnTy, fnPtr, args);
+    }
+
+    /**
+     * `fn<T1,T2->R>`: closures taking T1, T2 and returning R, as the
+     * value type { R (i8*, T1, T2)*, i8* }.
+     */
+    bool isClosureTypeName(const std::string &name)
+    {
+        return name.size() > 4 && name.compare(0, 3, "fn<") == 0 && name.back() == '>';
+    }
+
+    bool isClosureType(llvm::Type *type_)
+    {
+        auto structTy = llvm::dyn_cast<llvm::StructType>(type_);
+        return structTy != nullptr && structTy->hasName() && isClosureTypeName(structTy->getName().str());
+    }
+
+    llvm::StructType *getClosureType(const std::string &typeName)
+    {
+        if (auto closureTy = llvm::StructType::getTypeByName(*ctx, typeName))
+        {
+            return closureTy;
+        }
+
+        auto signature = typeName.substr(3, typeName.size() - 4);
+
+        std::vector<llvm::Type *> paramTys{builder->getInt8PtrTy()};
+        std::string returnName;
+        size_t start = 0;
+        int depth = 0;
+
+        for (size_t i = 0; i < signature.size(); i++)
+        {
+            if (signature.compare(i, 2, "->") == 0)
+            {
+                if (depth == 0)
+                {
+                    if (i > start)
+                    {
+                        paramTys.push_back(getTypeFromString(signature.substr(start, i - start)));
+                    }
+                    returnName = signature.substr(i + 2);
+                    break;
+                }
+                i++;
+            }
+            else if (signature[i] == '<')
+            {
+                depth++;
+            }
+            else if (signature[i] == '>')
+            {
+                depth--;
+            }
+            else if (signature[i] == ',' && depth == 0)
+            {
+                paramTys.push_back(getTypeFromString(signature.substr(start, i - start)));
+                start = i + 1;
+            }
+        }
+
+        if (returnName.empty())
+        {
+            DIE << "[EvaLLVM]: function type " << typeName << " has no -> return type";
+        }
+
+        auto fnTy = llvm::FunctionType::get(getTypeFromString(returnName), paramTys, false);
+        return llvm::StructType::create(*ctx, {fnTy->getPointerTo(), builder->getInt8PtrTy()}, typeName);
+    }
+
+    /**
+     * (for i from to body)
+     *
+     * Counted loop over [from, to): `to` is evaluated once, and `i` is
+     * scoped to the body and incremented without signed wrap, which
+     * gives LLVM a canonical loop with a computable trip count.
+     */
+    llvm::Value *genFor(const Exp &exp, Env env)
+    {
+        if (exp.list.size() != 5 || exp.list[1].type != ExpType::SYMBOL)
+        {
+            DIE << "[EvaLLVM]: for takes a variable, a start, an end and a body";
+        }
+
+        auto from = gen(exp.list[2], env);
+        auto to = gen(exp.list[3], env);
+        promoteOperands(from, to);
+
+        if (!from->getType()->isIntegerTy())
+        {
+            DIE << "[EvaLLVM]: for bounds must be integers";
+        }
+
+        auto loopEnv = std::make_shared<Environment>(
+            std::map<std::string, llvm::Value *>{}, env);
+
+        auto counterName = exp.list[1].string;
+        auto counter = allocVar(counterName, from->getType(), loopEnv);
+        builder->CreateStore(from, counter);
+
+        auto condBlock = createBB("for.cond", fn);
+        auto bodyBlock = createBB("for.body");
+        auto loopEndBlock = createBB("for.end");
+
+        builder->CreateBr(condBlock);
+
+        builder->SetInsertPoint(condBlock);
+        auto current = builder->CreateLoad(from->getType(), counter, counterName);
+        builder->CreateCondBr(builder->CreateICmpSLT(current, to, "for.cmp"), bodyBlock, loopEndBlock);
+
+        fn->getBasicBlockList().push_back(bodyBlock);
+        builder->SetInsertPoint(bodyBlock);
+        gen(exp.list[4], loopEnv);
+
+        if (options.instrumentCounters)
+        {
+            instrumentation->count(*builder, fn->getName().str() + ":for" +
+                                                 std::to_string(++loopCount_));
+        }
+
+        current = builder->CreateLoad(from->getType(), counter, counterName);
+        builder->CreateStore(builder->CreateNSWAdd(current, llvm::ConstantInt::get(from->getType(), 1),
+                                                   "for.next"),
+                             counter);
+        builder->CreateBr(condBlock);
+
+        fn->getBasicBlockList().push_back(loopEndBlock);
+        builder->SetInsertPoint(loopEndBlock);
+
+        return builder->getInt32(0);
+    }
+
+    /**
+     * (comptime expr)
+     *
+     * Compiles `expr` together with the top-level definitions before
+     * it, runs it in the JIT, and embeds the result as a constant.
+     * Numbers, booleans, strings and arrays of numbers can be embedded;
+     * arrays become read-only globals.
+     */
+    llvm::Constant *genComptime(const Exp &exp)
+    {
+        if (exp.list.size() != 2)
+        {
+            DIE << "[EvaLLVM]: comptime takes one expression";
+        }
+
+        std::vector<Exp> forms{program_->list[0]};
+        for (auto imported : imports_)
+        {
+            for (auto i = 1; i < imported->list.size(); i++)
+            {
+                if (!isVar(imported->list[i]) && !isTaggedList(imported->list[i], "import"))
+                {
+                    forms.push_back(imported->list[i]);
+                }
+            }
+        }
+        for (auto i = 1; i < topLevelIndex_; i++)
+        {
+            auto &form = program_->list[i];
+            if (isDef(form) || isTaggedList(form, "class") || isTaggedList(form, "struct") ||
+                (isVar(form) && isTaggedList(form.list[2], "comptime")))
+            {
+                forms.push_back(form);
+            }
+        }
+        forms.push_back(exp.list[1]);
+
+        EvaLLVM evaluator;
+        evaluator.evaluating_ = true;
+
+        std::string typeName;
+        auto value = evaluator.evaluate(Exp(forms), typeName);
+        return createConstant(value, typeName);
+    }
+
+    /**
+     * (var x (comptime expr)): `x` is bound to the constant itself, so
+     * functions defined after it can use it too. The evaluator keeps
+     * such variables in globals set at startup instead.
+     */
+    llvm::Value *genComptimeVar(const Exp &exp, Env env)
+    {
+        auto &varNameDecl = exp.list[1];
+        auto varName = extractVarName(varNameDecl);
+
+        if (!evaluating_)
+        {
+            llvm::Value *value = genComptime(exp.list[2]);
+            if (varNameDecl.type == ExpType::LIST)
+            {
+                value = castValue(value, extractVarType(varNameDecl));
+            }
+            return env->define(varName, value);
+        }
+
+        auto init = gen(exp.list[2].list[1], env);
+        auto varTy = varNameDecl.type == ExpType::LIST ? extractVarType(varNameDecl) : init->getType();
+        auto global = new llvm::GlobalVariable(*module, varTy, false, llvm::GlobalVariable::InternalLinkage,
+                                               llvm::Constant::getNullValue(varTy), varName);
+        builder->CreateStore(castValue(init, varTy), global);
+        return env->define(varName, global);
+    }
+
+    /**
+     * Runs `program` and returns the value of its last expression as a
+     * literal; arrays are returned as a list of their elements.
+     */
+    Exp evaluate(const Exp &program, std::string &typeName)
+    {
+        auto value = compileMain(program);
+        typeName = getComptimeTypeName(value->getType());
+
+        auto result = createGlobalVar("comptime.result", llvm::Constant::getNullValue(value->getType()));
+        builder->CreateStore(value, result);
+        builder->CreateRet(builder->getInt32(0));
+
+        if (llvm::verifyModule(*module, &llvm::errs()))
+        {
+            DIE << "[EvaLLVM]: invalid comptime module";
+        }
+
+        EvaJIT jit(false);
+        jit.run(std::move(module), std::move(ctx));
+        return readComptimeValue(jit.lookup("comptime.result"), typeName);
+    }
+
+    std::string getComptimeTypeName(llvm::Type *type_)
+    {
+        if (type_->isIntegerTy(1))
+        {
+            return "boolean";
+        }
+        if (type_->isIntegerTy(32))
+        {
+            return "number";
+        }
+        if (type_->isIntegerTy(64))
+        {
+            return "i64";
+        }
+        if (type_->isDoubleTy())
+        {
+            return "f64";
+        }
+        if (type_ == builder->getInt8PtrTy())
+        {
+            return "string";
+        }
+        if (type_->isPointerTy() && type_->getPointerElementType()->isStructTy())
+        {
+            auto structTy = llvm::cast<llvm::StructType>(type_->getPointerElementType());
+            auto elemTy = structTy->hasName() && isArrayTypeName(structTy->getName().str())
+                              ? getArrayElementType(type_)
+                              : nullptr;
+            if (elemTy != nullptr && (elemTy->isIntegerTy(32) || elemTy->isIntegerTy(64) || elemTy->isDoubleTy()))
+            {
+                return structTy->getName().str();
+            }
+        }
+
+        DIE << "[EvaLLVM]: comptime values must be numbers, booleans, strings or arrays of numbers";
+        return "";
+    }
+
+    Exp readComptimeValue(const void *address, const std::string &typeName)
+    {
+        Exp value(int64_t{0});
+
+        if (typeName == "number")
+        {
+            value.number = *(const int32_t *)address;
+        }
+        else if (typeName == "i64")
+        {
+            value.number = *(const int64_t *)address;
+        }
+        else if (typeName == "f64")
+        {
+            value.type = ExpType::FLOAT;
+            value.floatNumber = *(const double *)address;
+        }
+        else if (typeName == "boolean")
+        {
+            value.type = ExpType::SYMBOL;
+            value.string = (*(const uint8_t *)address & 1) != 0 ? "true" : "false";
+        }
+        else if (typeName == "string")
+        {
+            value.type = ExpType::STRING;
+            value.string = *(const char *const *)address;
+        }
+        else
+        {
+            auto elemTypeName = typeName.substr(6, typeName.size() - 7);
+            auto elemSize = elemTypeName == "number" ? 4 : 8;
+
+            auto array = *(const char *const *)address;
+            auto length = *(const int64_t *)array;
+
+            value.type = ExpType::LIST;
+            for (int64_t i = 0; i < length; i++)
+            {
+                value.list.push_back(readComptimeValue(array + sizeof(int64_t) + i * elemSize, elemTypeName));
+            }
+        }
+
+        return value;
+    }
+
+    llvm::Constant *createConstant(const Exp &value, const std::string &typeName)
+    {
+        if (typeName == "number")
+        {
+            return builder->getInt32(value.number);
+        }
+        if (typeName == "i64")
+        {
+            return builder->getInt64(value.number);
+        }
+        if (typeName == "f64")
+        {
+            return llvm::ConstantFP::get(builder->getDoubleTy(), value.floatNumber);
+        }
+        if (typeName == "boolean")
+        {
+            return builder->getInt1(value.string == "true");
+        }
+        if (typeName == "string")
+        {
+            return builder->CreateGlobalStringPtr(value.string);
+        }
+
+        if (isPreciseGC())
+        {
+            DIE << "[EvaLLVM]: comptime arrays are not supported with --gc=statepoint";
+        }
+
+        auto elemTypeName = typeName.substr(6, typeName.size() - 7);
+        std::vector<llvm::Constant *> elements;
+        for (const auto &element : value.list)
+        {
+            elements.push_back(createConstant(element, elemTypeName));
+        }
+
+        auto data = llvm::ConstantArray::get(
+            llvm::ArrayType::get(getTypeFromString(elemTypeName), elements.size()), elements);
+        auto init = llvm::ConstantStruct::getAnon({builder->getInt64(elements.size()), data});
+
+        auto global = new llvm::GlobalVariable(*module, init->getType(), true, llvm::GlobalVariable::PrivateLinkage,
+                                               init, "comptime");
+        global->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+        return llvm::ConstantExpr::getBitCast(global, getArrayType(elemTypeName)->getPointerTo());
+    }
+
+    bool isArrayTypeName(const std::string &name)
+    {
+        return name.size() > 7 && name.compare(0, 6, "array<") == 0 && name.back() == '>';
+    }
+
+    /**
+     * `array<T>`: { i64 length, [0 x T] elements }, allocated as one
+     * block on the GC heap and referenced by pointer like instances.
+     */
+    llvm::StructType *getArrayType(const std::string &elemTypeName)
+    {
+        auto name = "array<" + elemTypeName + ">";
+
+        if (auto arrayTy = llvm::StructType::getTypeByName(*ctx, name))
+        {
+            return arrayTy;
+        }
+
+        auto elemTy = getTypeFromString(elemTypeName);
+        return llvm::StructType::create(*ctx, {builder->getInt64Ty(), llvm::ArrayType::get(elemTy, 0)}, name);
+    }
+
+    llvm::StructType *getArrayStruct(llvm::Type *type_)
+    {
+        if (type_->isPointerTy())
+        {
+            auto structTy = llvm::dyn_cast<llvm::StructType>(type_->getPointerElementType());
+            if (structTy != nullptr && structTy->hasName() && isArrayTypeName(structTy->getName().str()))
+            {
+                return structTy;
+            }
+        }
+
+        std::string typeName;
+        llvm::raw_string_ostream typeStream(typeName);
+        type_->print(typeStream);
+        DIE << "[EvaLLVM]: " << typeStream.str() << " is not an array";
+        return nullptr;
+    }
+
+    llvm::Type *getArrayElementType(llvm::Type *type_)
+    {
+        return getArrayStruct(type_)->getElementType(1)->getArrayElementType();
+    }
+
+    llvm::Value *getElementAddress(llvm::Value *array, llvm::Value *index)
+    {
+        auto arrayTy = getArrayStruct(array->getType());
+        return builder->CreateInBoundsGEP(
+            arrayTy, array, {builder->getInt32(0), builder->getInt32(1), castValue(index, builder->getInt64Ty())},
+            "elemptr");
+    }
+
+    /**
+     * (array T length)
+     *
+     * Zero-initialized. Element data is never scanned by Boehm GC when
+     * it holds no pointers; the precise collector gets an array map.
+     */
+    llvm::Value *createArray(const Exp &exp, Env env)
+    {
+        if (exp.list.size() != 3 || exp.list[1].type != ExpType::SYMBOL)
+        {
+            DIE << "[EvaLLVM]: array takes an element type and a length";
+        }
+
+        auto arrayTy = getArrayType(exp.list[1].string);
+        auto elemTy = getArrayElementType(arrayTy->getPointerTo());
+        auto arrayName = arrayTy->getName().str();
+
+        auto length = castValue(gen(exp.list[2], env), builder->getInt64Ty());
+        auto dataOffset = module->getDataLayout().getStructLayout(arrayTy)->getElementOffset(1);
+        auto size = builder->CreateAdd(builder->getInt64(dataOffset),
+                                       builder->CreateMul(length, builder->getInt64(getTypeSize(elemTy))),
+                                       "array.size");
+
+        std::vector<uint64_t> pointerOffsets;
+        collectPointerOffsets(elemTy, 0, false, pointerOffsets);
+
+        llvm::Value *mallocPtr;
+        if (isPreciseGC())
+        {
+            mallocPtr = builder->CreateCall(module->getFunction("__eva_gc_alloc"),
+                                            {size, builder->CreateBitCast(getArrayMap(arrayTy), builder->getInt8PtrTy())},
+                                            "array");
+        }
+        else if (!pointerOffsets.empty())
+        {
+            mallocPtr = builder->CreateCall(module->getFunction("GC_malloc"), size, "array");
+        }
+        else
+        {
+            mallocPtr = builder->CreateCall(module->getFunction("GC_malloc_atomic"), size, "array");
+
+            // GC_malloc_atomic memory is not cleared.
+            builder->CreateMemSet(mallocPtr, builder->getInt8(0), size, llvm::MaybeAlign(8));
+        }
+
+        if (options.instrumentAllocs)
+        {
+            instrumentation->countAllocation(*builder, arrayName, size);
+        }
+
+        auto array = builder->CreatePointerCast(mallocPtr, arrayTy->getPointerTo(objectAddressSpace()));
+        auto lengthStore = builder->CreateStore(length, builder->CreateStructGEP(arrayTy, array, 0));
+        lengthStore->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAElementTag("array length"));
+
+        return array;
+    }
+
+    /**
+     * (struct Name (begin (var (field type) init)...))
+     *
+     * Value types: no vtable, no parent, no methods. They are stored
+     * inline in variables, fields, arguments and return values.
+     */
+    void compileStruct(const Exp &exp)
+    {
+        auto name = exp.list[1].string;
+
+        if (exp.list.size() != 3 || !isTaggedList(exp.list[2], "begin"))
+        {
+            DIE << "[EvaLLVM]: struct " << name << " takes a name and a (begin ...) of fields";
+        }
+
+        if (structMap_.count(name) != 0 || classMap_.count(name) != 0)
+        {
+            DIE << "[EvaLLVM]: struct " << name << " is already defined";
+        }
+
+        StructInfo structInfo;
+        std::vector<llvm::Type *> fieldTypes;
+
+        auto &body = exp.list[2];
+        for (auto i = 1; i < body.list.size(); i++)
+        {
+            auto &member = body.list[i];
+            if (!isVar(member))
+            {
+                DIE << "[EvaLLVM]: struct " << name << " may only declare fields";
+            }
+
+            auto fieldTy = extractVarType(member.list[1]);
+            if (isPreciseGC() && containsObjectPointer(fieldTy))
+            {
+                DIE << "[EvaLLVM]: struct " << name << " cannot hold objects with --gc=statepoint";
+            }
+
+            structInfo.fieldNames.push_back(extractVarName(member.list[1]));
+            structInfo.inits.push_back(member.list[2]);
+            fieldTypes.push_back(fieldTy);
+        }
+
+        structInfo.type = llvm::StructType::create(*ctx, fieldTypes, name);
+        structMap_[name] = structInfo;
+    }
+
+    /**
+     * (new Name args...): fields in declaration order, then initializers.
+     */
+    llvm::Value *createStructValue(const Exp &exp, Env env)
+    {
+        auto &structInfo = structMap_[exp.list[1].string];
+
+        if (exp.list.size() - 2 > structInfo.fieldNames.size())
+        {
+            DIE << "[EvaLLVM]: too many fields for struct " << exp.list[1].string;
+        }
+
+        llvm::Value *value = llvm::UndefValue::get(structInfo.type);
+        for (auto i = 0; i < structInfo.fieldNames.size(); i++)
+        {
+            auto field = i + 2 < exp.list.size() ? gen(exp.list[i + 2], env)
+                                                 : gen(structInfo.inits[i], env);
+            value = builder->CreateInsertValue(
+                value, castValue(field, structInfo.type->getElementType(i)), i);
+        }
+        return value;
+    }
+
+    bool isStructName(const std::string &name)
+    {
+        return structMap_.count(name) != 0;
+    }
+
+    unsigned getStructFieldIndex(llvm::StructType *structTy, const std::string &fieldName)
+    {
+        auto &fieldNames = structMap_[structTy->getName().str()].fieldNames;
+        auto it = std::find(fieldNames.begin(), fieldNames.end(), fieldName);
+        if (it == fieldNames.end())
+        {
+            DIE << "[EvaLLVM]: struct " << structTy->getName().str() << " has no field " << fieldName;
+        }
+        return it - fieldNames.begin();
+    }
+
+    void buildClassInfo(llvm::StructType *cls, const Exp &clsExp, Env env)
+    {
+        auto className = clsExp.list[1].string;
+        auto classInfo = &classMap_[className];
+
+        auto &body = clsExp.list[3];
+
+        for (auto i = 1; i < body.list.size(); i++)
+        {
+            auto &exp = body.list[i];
+
+            if (isVar(exp))
+            {
+                auto &varNameDecl = exp.list[1];
+
+                auto fieldName = extractVarName(varNameDecl);
+                auto fieldTy = extractVarType(varNameDecl);
+
+                if (classInfo->fieldTypes.count(fieldName) == 0)
+                {
+                    classInfo->declaredFields.push_back(fieldName);
+                }
+                classInfo->fieldTypes[fieldName] = fieldTy;
+            }
+            else if (isDef(exp))
+            {
+                auto methodName = exp.list[1].string;
+                if (!reachability_.isDispatched(methodName))
+                {
+                    continue;
+                }
+
+                auto fnName = className + "_" + methodName;
+                auto fnTy = extractFcuntionType(exp);
+                auto method = reachability_.isMethodLive(className, methodName)
+                                  ? (llvm::Function *)createFunctionProto(fnName, fnTy, env)
+                                  : nullptr;
+
+                auto slot = classInfo->methodSlots.find(methodName);
+                if (slot != classInfo->methodSlots.end())
+                {
+                    classInfo->methods[slot->second] = method;
+                    classInfo->methodTypes[slot->second] = fnTy;
+                }
+                else
+                {
+                    classInfo->methodSlots[methodName] = classInfo->methodOrder.size();
+                    classInfo->methodOrder.push_back(methodName);
+                    classInfo->methods.push_back(method);
+                    classInfo->methodTypes.push_back(fnTy);
+                }
+
+                if (methodName == "constructor")
+                {
+                    classInfo->constructor = method;
+                }
+            }
+        }
+
+        buildClassBody(cls);
+    }
+
+    void buildClassBody(llvm::StructType *cls)
+    {
+        std::string className{cls->getName().data()};
+
+        auto classInfo = &classMap_[className];
+
+        classInfo->vTableTy = llvm::StructType::create(*ctx, className + "_vTable");
+
+        auto clsFields = std::vector<llvm::Type *>{
+            classInfo->vTableTy->getPointerTo(),
+        };
+
+        classInfo->fieldOrder = layoutFields(className);
+        classInfo->fieldSlots.clear();
+        for (const auto &fieldName : classInfo->fieldOrder)
+        {
+            classInfo->fieldSlots[fieldName] = clsFields.size();
+            clsFields.push_back(classInfo->fieldTypes[fieldName]);
+        }
+
+        cls->setBody(clsFields, false);
+
+        classInfo->tbaaType = buildTBAAClassType(cls);
+
+        buildVTable(cls);
+    }
+
+    /**
+     * Field order of a class: the parent's layout as a stable prefix,
+     * then the class's own fields. Own fields with a `--field-profile`
+     * count within 10% of the class's hottest field go first, to share
+     * the first cache line; within each group fields are ordered by
+     * decreasing alignment, which leaves no interior padding.
+     */
+    std::vector<std::string> layoutFields(const std::string &className)
+    {
+        auto classInfo = &classMap_[className];
+
+        std::vector<std::string> order;
+        std::vector<std::string> ownFields;
+
+        if (classInfo->parent != nullptr)
+        {
+            order = classInfo->parent->fieldOrder;
+        }
+
+        for (const auto &field : classInfo->declaredFields)
+        {
+            if (std::find(order.begin(), order.end(), field) == order.end())
+            {
+                ownFields.push_back(field);
+            }
+        }
+
+        uint64_t maxCount = 0;
+        for (const auto &field : ownFields)
+        {
+            maxCount = std::max(maxCount, getFieldProfileCount(className, field));
+        }
+
+        auto &dataLayout = module->getDataLayout();
+        auto isHot = [&](const std::string &field)
+        {
+            return maxCount != 0 && getFieldProfileCount(className, field) * 10 >= maxCount;
+        };
+
+        std::stable_sort(ownFields.begin(), ownFields.end(),
+                         [&](const std::string &a, const std::string &b)
+                         {
+                             if (isHot(a) != isHot(b))
+                             {
+                                 return isHot(a);
+                             }
+                             return dataLayout.getABITypeAlignment(classInfo->fieldTypes[a]) >
+                                    dataLayout.getABITypeAlignment(classInfo->fieldTypes[b]);
+                         });
+
+        order.insert(order.end(), ownFields.begin(), ownFields.end());
+        return order;
+    }
+
+    uint64_t getFieldProfileCount(const std::string &className, const std::string &fieldName)
+    {
+        auto it = fieldProfile_.find(className + "." + fieldName);
+        return it == fieldProfile_.end() ? 0 : it->second;
+    }
+
+    /**
+     * Reads `--instrument=fields` report lines: "<count>  <Class>.<field>".
+     */
+    void loadFieldProfile()
+    {
+        if (options.fieldProfile.empty())
+        {
+            return;
+        }
+
+        std::ifstream profileFile(options.fieldProfile);
+        if (!profileFile)
+        {
+            DIE << "[EvaLLVM]: cannot read field profile " << options.fieldProfile;
+        }
+
+        std::string line;
+        while (std::getline(profileFile, line))
+        {
+            std::stringstream fields(line);
+            uint64_t count;
+            std::string name;
+
+            if (fields >> count >> name && name.find('.') != std::string::npos)
+            {
+                fieldProfile_[name] += count;
+            }
+        }
+    }
+
+    /**
+     * Struct-path TBAA type for a class: the parent's type node at offset 0
+     * followed by the class's own fields, so a field is only aliased by
+     * accesses to the same field through the class or its ancestors.
+     */
+    llvm::MDNode *buildTBAAClassType(llvm::StructType *cls)
+    {
+        auto classInfo = &getClassInfo(cls);
+        auto layout = module->getDataLayout().getStructLayout(cls);
+
+        std::vector<std::pair<llvm::MDNode *, uint64_t>> fields;
+        auto firstOwnField = RESERVED_FIELDS_COUNT;
+
+        if (classInfo->parent != nullptr)
+        {
+            fields.push_back({classInfo->parent->tbaaType, 0});
+            firstOwnField = classInfo->parent->cls->getNumElements();
+        }
+        else
+        {
+            fields.push_back({getTBAAScalarType("vtable pointer"), 0});
+        }
+
+        for (auto i = firstOwnField; i < cls->getNumElements(); i++)
+        {
+            fields.push_back({getTBAAScalarType(cls->getElementType(i)), layout->getElementOffset(i)});
+        }
+
+        return llvm::MDBuilder(*ctx).createTBAAStructTypeNode(cls->getName(), fields);
+    }
+
+    llvm::MDNode *getTBAAAccessTag(llvm::StructType *cls, size_t fieldIdx)
+    {
+        // Struct-valued fields are accessed as aggregates; left untagged.
+        if (cls->getElementType(fieldIdx)->isAggregateType())
+        {
+            return nullptr;
+        }
+
+        auto accessType = fieldIdx == VTABLE_INDEX ? getTBAAScalarType("vtable pointer")
+                                                   : getTBAAScalarType(cls->getElementType(fieldIdx));
+
+        auto classType = getClassInfo(cls).tbaaType;
+        auto offset = module->getDataLayout().getStructLayout(cls)->getElementOffset(fieldIdx);
+        return llvm::MDBuilder(*ctx).createTBAAStructTagNode(classType, accessType, offset);
+    }
+
+    /**
+     * Array lengths and elements are accessed as scalars of their own
+     * type; struct elements are aggregates and left untagged.
+     */
+    llvm::MDNode *getTBAAElementTag(llvm::Type *elemTy)
+    {
+        if (elemTy->isAggregateType())
+        {
+            return nullptr;
+        }
+
+        auto scalarType = getTBAAScalarType(elemTy);
+        return llvm::MDBuilder(*ctx).createTBAAStructTagNode(scalarType, scalarType, 0);
+    }
+
+    llvm::MDNode *getTBAAElementTag(const std::string &name)
+    {
+        auto scalarType = getTBAAScalarType(name);
+        return llvm::MDBuilder(*ctx).createTBAAStructTagNode(scalarType, scalarType, 0);
+    }
+
+    llvm::MDNode *getTBAAScalarType(llvm::Type *type_)
+    {
+        if (type_->isPointerTy())
+        {
+            return getTBAAScalarType("any pointer");
+        }
+
+        std::string typeName;
+        llvm::raw_string_ostream typeStream(typeName);
+        type_->print(typeStream);
+        return getTBAAScalarType(typeStream.str());
+    }
+
+    llvm::MDNode *getTBAAScalarType(const std::string &name)
+    {
+        llvm::MDBuilder mdBuilder(*ctx);
+
+        if (tbaaRoot_ == nullptr)
+        {
+            tbaaRoot_ = mdBuilder.createTBAAScalarTypeNode(
+                "omnipotent char", mdBuilder.createTBAARoot("Eva TBAA"));
+        }
+
+        return mdBuilder.createTBAAScalarTypeNode(name, tbaaRoot_);
+    }
+
+    /**
+     * Only classes that are instantiated get a vtable; every slot of it
+     * is then reachable.
+     */
+    void buildVTable(llvm::StructType *cls)
+    {
+        auto &classInfo = getClassInfo(cls);
+
+        std::vector<llvm::Type *> vTableMethodTys;
+        for (auto methodTy : classInfo.methodTypes)
+        {
+            vTableMethodTys.push_back(methodTy->getPointerTo());
+        }
+
+        classInfo.vTableTy->setBody(vTableMethodTys);
+
+        if (declaring_)
+        {
+            classInfo.vTable = new llvm::GlobalVariable(*module, classInfo.vTableTy, true,
+                                                        llvm::GlobalValue::ExternalLinkage, nullptr,
+                                                        classInfo.name + "_vTable");
+            return;
+        }
+
+        if (!reachability_.isInstantiated(classInfo.name))
+        {
+            return;
+        }
+
+        std::vector<llvm::Constant *> vTableMethods(classInfo.methods.begin(), classInfo.methods.end());
+        if (std::count(vTableMethods.begin(), vTableMethods.end(), nullptr) != 0)
+        {
+            DIE << "[EvaLLVM]: unreachable method in the vtable of " << classInfo.name;
+        }
+
+        auto vTableValue = llvm::ConstantStruct::get(classInfo.vTableTy, vTableMethods);
+        classInfo.vTable = createGlobalVar(classInfo.name + "_vTable", vTableValue, true);
+        if (!options.separate)
+        {
+            classInfo.vTable->setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+    }
+
+    bool isTaggedList(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    bool isVar(const Exp &exp)
+    {
+        return isTaggedList(exp, "var");
+    }
+
+    bool isDef(const Exp &exp)
+    {
+        return isTaggedList(exp, "def");
+    }
+
+    bool isNew(const Exp &exp)
+    {
+        return isTaggedList(exp, "new");
+    }
+
+    bool isProp(const Exp &exp)
+    {
+        return isTaggedList(exp, "prop");
+    }
+
+    bool isSuper(const Exp &exp)
+    {
+        return isTaggedList(exp, "super");
+    }
+
+    /**
+     * Instances are allocated by the layout of their pointer fields
+     * (the vtable pointer refers to a static global and is not traced):
+     * no pointers - GC_malloc_atomic, the object is never scanned;
+     * otherwise   - GC_malloc_explicitly_typed with a precise bitmap.
+     *
+     * Small instances take an inline fast path instead, see bumpAlloc
+     * and freeListAlloc.
+     *
+     * Inside `with-arena` instances come from the arena: directly when
+     * the block is lexically visible, otherwise (callees) if an arena
+     * is active at run time.
+     */
+    llvm::Value *mallocInstance(llvm::StructType *cls, const std::string &name)
+    {
+        auto typeSize = builder->getInt64(getTypeSize(cls));
+
+        llvm::Value *mallocPtr;
+        if (isPreciseGC())
+        {
+            mallocPtr = builder->CreateCall(module->getFunction("__eva_gc_alloc"),
+                                            {typeSize, builder->CreateBitCast(getObjectMap(cls), builder->getInt8PtrTy())},
+                                            name);
+        }
+        else if (arenaDepth_ > 0)
+        {
+            mallocPtr = arenaAlloc(getTypeSize(cls), name);
+        }
+        else if (usesArenas_)
+        {
+            auto arena = getArena();
+            auto arenaEnd = builder->CreateLoad(builder->getInt8PtrTy(),
+                                                builder->CreateStructGEP(arena->getValueType(), arena, 1),
+                                                "arena.end");
+
+            auto arenaBlock = createBB("alloc.arena", fn);
+            auto heapBlock = createBB("alloc.heap");
+            auto mergeBlock = createBB("alloc.merge");
+
+            builder->CreateCondBr(builder->CreateIsNotNull(arenaEnd), arenaBlock, heapBlock);
+
+            builder->SetInsertPoint(arenaBlock);
+            auto arenaPtr = arenaAlloc(getTypeSize(cls), name);
+            arenaBlock = builder->GetInsertBlock();
+            builder->CreateBr(mergeBlock);
+
+            fn->getBasicBlockList().push_back(heapBlock);
+            builder->SetInsertPoint(heapBlock);
+            auto heapPtr = heapAlloc(cls, name);
+            heapBlock = builder->GetInsertBlock();
+            builder->CreateBr(mergeBlock);
+
+            fn->getBasicBlockList().push_back(mergeBlock);
+            builder->SetInsertPoint(mergeBlock);
+            auto phi = builder->CreatePHI(builder->getInt8PtrTy(), 2, name);
+            phi->addIncoming(arenaPtr, arenaBlock);
+            phi->addIncoming(heapPtr, heapBlock);
+            mallocPtr = phi;
+        }
+        else
+        {
+            mallocPtr = heapAlloc(cls, name);
+        }
+
+        auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo(objectAddressSpace()));
+
+        // GC_malloc_atomic memory is not cleared.
+        if (!hasPointerFields(cls))
+        {
+            builder->CreateStore(llvm::Constant::getNullValue(cls), instance);
+        }
+
+        std::string className{cls->getName().data()};
+
+        if (options.instrumentAllocs)
+        {
+            instrumentation->countAllocation(*builder, className, typeSize);
+        }
+
+        initVTable(cls, instance);
+
+        return instance;
+    }
+
+    llvm::Value *heapAlloc(llvm::StructType *cls, const std::string &name)
+    {
+        auto typeSize = builder->getInt64(getTypeSize(cls));
+
+        llvm::Value *mallocPtr;
+        if (getTypeSize(cls) <= SMALL_OBJECT_SIZE)
+        {
+            mallocPtr = hasPointerFields(cls) ? freeListAlloc(cls, name)
+                                              : bumpAlloc(getTypeSize(cls), name);
+        }
+        else if (hasPointerFields(cls))
+        {
+            auto descr = getGCDescriptor(cls);
+            mallocPtr = builder->CreateCall(
+                module->getFunction("GC_malloc_explicitly_typed"),
+                {typeSize, builder->CreateLoad(builder->getInt64Ty(), descr, "gcdescr")}, name);
+        }
+        else
+        {
+            mallocPtr = builder->CreateCall(module->getFunction("GC_malloc_atomic"), typeSize, name);
+        }
+
+        return mallocPtr;
+    }
+
+    /**
+     * Pointer-free instances: bump allocation from the current thread's
+     * GC_malloc_atomic chunk. A chunk stays alive while any instance
+     * carved from it does; it is never scanned.
+     */
+    llvm::Value *bumpAlloc(size_t size, const std::string &name)
+    {
+        return bumpAlloc(size, name, getTLAB(), getTLABRefillFunction());
+    }
+
+    llvm::Value *arenaAlloc(size_t size, const std::string &name)
+    {
+        return bumpAlloc(size, name, getArena(), getArenaRefillFunction());
+    }
+
+    /**
+     * Inline bump of a { i8* cur, i8* end, ... } buffer; `refillFn`
+     * takes the size and returns the instance once the buffer is full.
+     */
+    llvm::Value *bumpAlloc(size_t size, const std::string &name,
+                           llvm::GlobalVariable *tlab, llvm::Function *refillFn)
+    {
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto tlabTy = tlab->getValueType();
+
+        size = llvm::alignTo(size, module->getDataLayout().getPointerSize());
+
+        auto curPtr = builder->CreateStructGEP(tlabTy, tlab, 0);
+        auto cur = builder->CreateLoad(bytePtrTy, curPtr, "bump.cur");
+        auto end = builder->CreateLoad(bytePtrTy, builder->CreateStructGEP(tlabTy, tlab, 1), "bump.end");
+        auto next = builder->CreateGEP(builder->getInt8Ty(), cur, builder->getInt64(size), "bump.next");
+
+        auto fastBlock = createBB("alloc.fast", fn);
+        auto slowBlock = createBB("alloc.slow", fn);
+        auto doneBlock = createBB("alloc.done", fn);
+
+        builder->CreateCondBr(builder->CreateICmpULE(next, end), fastBlock, slowBlock,
+                              llvm::MDBuilder(*ctx).createBranchWeights(2000, 1));
+
+        builder->SetInsertPoint(fastBlock);
+        builder->CreateStore(next, curPtr);
+        builder->CreateBr(doneBlock);
+
+        builder->SetInsertPoint(slowBlock);
+        auto refilled = builder->CreateCall(refillFn, builder->getInt64(size));
+        builder->CreateBr(doneBlock);
+
+        builder->SetInsertPoint(doneBlock);
+        auto instance = builder->CreatePHI(bytePtrTy, 2, name);
+        instance->addIncoming(cur, fastBlock);
+        instance->addIncoming(refilled, slowBlock);
+
+        return instance;
+    }
+
+    /**
+     * Instances with pointers: pop from the current thread's free list
+     * for their class, refilled in batches of explicitly typed objects
+     * so they keep their precise layout. The list is linked through the
+     * first pointer field, which the class's descriptor traces, and the
+     * link is cleared when an instance is taken.
+     */
+    llvm::Value *freeListAlloc(llvm::StructType *cls, const std::string &name)
+    {
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto freeList = getFreeList(cls);
+        auto linkOffset = getPointerOffsets(cls, false).front();
+
+        auto head = builder->CreateLoad(bytePtrTy, freeList, "freelist.head");
+
+        auto fastBlock = createBB("alloc.fast", fn);
+        auto slowBlock = createBB("alloc.slow", fn);
+        auto doneBlock = createBB("alloc.done", fn);
+
+        builder->CreateCondBr(builder->CreateIsNotNull(head), fastBlock, slowBlock,
+                              llvm::MDBuilder(*ctx).createBranchWeights(2000, 1));
+
+        builder->SetInsertPoint(fastBlock);
+        auto next = builder->CreateLoad(bytePtrTy, getFreeListLink(*builder, head, linkOffset),
+                                        "freelist.next");
+        builder->CreateStore(next, freeList);
+        builder->CreateBr(doneBlock);
+
+        builder->SetInsertPoint(slowBlock);
+        auto refilled = builder->CreateCall(getFreeListRefillFunction(cls));
+        builder->CreateBr(doneBlock);
+
+        builder->SetInsertPoint(doneBlock);
+        auto instance = builder->CreatePHI(bytePtrTy, 2, name);
+        instance->addIncoming(head, fastBlock);
+        instance->addIncoming(refilled, slowBlock);
+
+        builder->CreateStore(llvm::Constant::getNullValue(bytePtrTy),
+                             getFreeListLink(*builder, instance, linkOffset));
+
+        return instance;
+    }
+
+    llvm::Value *getFreeListLink(llvm::IRBuilder<> &linkBuilder, llvm::Value *object, uint64_t linkOffset)
+    {
+        auto bytePtrTy = linkBuilder.getInt8PtrTy();
+        auto link = linkBuilder.CreateConstGEP1_64(linkBuilder.getInt8Ty(), object, linkOffset);
+        return linkBuilder.CreateBitCast(link, bytePtrTy->getPointerTo());
+    }
+
+    /**
+     * Thread-local { i8* cur, i8* end } atomic allocation buffer.
+     */
+    llvm::GlobalVariable *getTLAB()
+    {
+        auto tlab = module->getNamedGlobal("__eva_tlab");
+        if (tlab != nullptr)
+        {
+            return tlab;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto tlabTy = llvm::StructType::get(*ctx, {bytePtrTy, bytePtrTy});
+        tlab = new llvm::GlobalVariable(*module, tlabTy, false, llvm::GlobalValue::InternalLinkage,
+                                        llvm::Constant::getNullValue(tlabTy), "__eva_tlab");
+        setThreadLocal(tlab);
+        return tlab;
+    }
+
+    /**
+     * Thread-local { i8* cur, i8* end, i8* chunks } of the innermost
+     * active arena; `end` is null outside of `with-arena`.
+     */
+    llvm::GlobalVariable *getArena()
+    {
+        auto arena = module->getNamedGlobal("__eva_arena");
+        if (arena != nullptr)
+        {
+            return arena;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto arenaTy = llvm::StructType::get(*ctx, {bytePtrTy, bytePtrTy, bytePtrTy});
+        arena = new llvm::GlobalVariable(*module, arenaTy, false, llvm::GlobalValue::InternalLinkage,
+                                         llvm::Constant::getNullValue(arenaTy), "__eva_arena");
+        setThreadLocal(arena);
+        return arena;
+    }
+
+    /**
+     * RuntimeDyld (LLVM 14) cannot resolve TLS relocations; the JIT runs
+     * `main` on a single thread, so there the buffers are plain globals.
+     */
+    void setThreadLocal(llvm::GlobalVariable *buffer)
+    {
+        buffer->setThreadLocal(!options.jit);
+    }
+
+    llvm::GlobalVariable *getFreeList(llvm::StructType *cls)
+    {
+        auto listName = "__eva_freelist_" + cls->getName().str();
+
+        auto freeList = module->getNamedGlobal(listName);
+        if (freeList != nullptr)
+        {
+            return freeList;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        freeList = new llvm::GlobalVariable(*module, bytePtrTy, false, llvm::GlobalValue::InternalLinkage,
+                                            llvm::Constant::getNullValue(bytePtrTy), listName);
+        setThreadLocal(freeList);
+        return freeList;
+    }
+
+    /**
+     * Slow paths. The collector does not scan thread-local storage, so
+     * each refill (re-)registers the buffer as a root; GC_add_roots
+     * ignores ranges it already has.
+     */
+    llvm::Function *createRefillFunction(const std::string &name, llvm::FunctionType *fnType)
+    {
+        auto refillFn = llvm::Function::Create(fnType, llvm::Function::InternalLinkage, name, *module);
+        refillFn->addFnAttr(llvm::Attribute::NoInline);
+        refillFn->addFnAttr(llvm::Attribute::Cold);
+        createBB("entry", refillFn);
+        return refillFn;
+    }
+
+    void addRoot(llvm::IRBuilder<> &refillBuilder, llvm::GlobalVariable *root)
+    {
+        auto bytePtrTy = refillBuilder.getInt8PtrTy();
+        auto rootEnd = refillBuilder.CreateConstGEP1_32(root->getValueType(), root, 1);
+        refillBuilder.CreateCall(module->getFunction("GC_add_roots"),
+                                 {refillBuilder.CreateBitCast(root, bytePtrTy),
+                                  refillBuilder.CreateBitCast(rootEnd, bytePtrTy)});
+    }
+
+    llvm::Function *getTLABRefillFunction()
+    {
+        auto refillFn = module->getFunction("__eva_tlab_refill");
+        if (refillFn != nullptr)
+        {
+            return refillFn;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        refillFn = createRefillFunction(
+            "__eva_tlab_refill", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+
+        auto tlab = getTLAB();
+        auto tlabTy = tlab->getValueType();
+
+        llvm::IRBuilder<> refillBuilder(&refillFn->getEntryBlock());
+        addRoot(refillBuilder, tlab);
+
+        auto chunk = refillBuilder.CreateCall(module->getFunction("GC_malloc_atomic"),
+                                              refillBuilder.getInt64(ATOMIC_CHUNK_SIZE), "chunk");
+        refillBuilder.CreateStore(refillBuilder.CreateGEP(refillBuilder.getInt8Ty(), chunk, refillFn->getArg(0)),
+                                  refillBuilder.CreateStructGEP(tlabTy, tlab, 0));
+        refillBuilder.CreateStore(refillBuilder.CreateConstGEP1_64(refillBuilder.getInt8Ty(), chunk, ATOMIC_CHUNK_SIZE),
+                                  refillBuilder.CreateStructGEP(tlabTy, tlab, 1));
+        refillBuilder.CreateRet(chunk);
+
+        return refillFn;
+    }
+
+    /**
+     * Arena chunks are GC_malloc_uncollectable, so the collector still
+     * scans them for pointers to the heap but never frees them. Each
+     * chunk starts with a link to the previous one.
+     */
+    llvm::Function *getArenaRefillFunction()
+    {
+        auto refillFn = module->getFunction("__eva_arena_refill");
+        if (refillFn != nullptr)
+        {
+            return refillFn;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto int64Ty = builder->getInt64Ty();
+        refillFn = createRefillFunction(
+            "__eva_arena_refill", llvm::FunctionType::get(bytePtrTy, int64Ty, false));
+
+        auto arena = getArena();
+        auto arenaTy = arena->getValueType();
+        auto headerSize = module->getDataLayout().getPointerSize();
+
+        llvm::IRBuilder<> refillBuilder(&refillFn->getEntryBlock());
+
+        auto size = refillFn->getArg(0);
+        auto minChunkSize = refillBuilder.CreateAdd(size, refillBuilder.getInt64(headerSize));
+        auto chunkSize = refillBuilder.CreateSelect(
+            refillBuilder.CreateICmpUGT(minChunkSize, refillBuilder.getInt64(ARENA_CHUNK_SIZE)),
+            minChunkSize, refillBuilder.getInt64(ARENA_CHUNK_SIZE), "chunksize");
+
+        auto chunk = refillBuilder.CreateCall(module->getFunction("GC_malloc_uncollectable"),
+                                              chunkSize, "chunk");
+        auto chunksPtr = refillBuilder.CreateStructGEP(arenaTy, arena, 2);
+        refillBuilder.CreateStore(refillBuilder.CreateLoad(bytePtrTy, chunksPtr),
+                                  refillBuilder.CreateBitCast(chunk, bytePtrTy->getPointerTo()));
+        refillBuilder.CreateStore(chunk, chunksPtr);
+
+        auto instance = refillBuilder.CreateConstGEP1_64(refillBuilder.getInt8Ty(), chunk, headerSize);
+        refillBuilder.CreateStore(refillBuilder.CreateGEP(refillBuilder.getInt8Ty(), instance, size),
+                                  refillBuilder.CreateStructGEP(arenaTy, arena, 0));
+        refillBuilder.CreateStore(refillBuilder.CreateGEP(refillBuilder.getInt8Ty(), chunk, chunkSize),
+                                  refillBuilder.CreateStructGEP(arenaTy, arena, 1));
+        refillBuilder.CreateRet(instance);
+
+        return refillFn;
+    }
+
+    /**
+     * Frees a chunk list built by __eva_arena_refill.
+     */
+    llvm::Function *getArenaReleaseFunction()
+    {
+        auto releaseFn = module->getFunction("__eva_arena_release");
+        if (releaseFn != nullptr)
+        {
+            return releaseFn;
+        }
 
-        auto vTableTy = llvm::StructType::getTypeByName(*ctx, vTableName);
+        auto bytePtrTy = builder->getInt8PtrTy();
+        releaseFn = llvm::Function::Create(llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false),
+                                           llvm::Function::InternalLinkage, "__eva_arena_release", *module);
 
-        std::vector<llvm::Constant *> vTableMethods;
-        std::vector<llvm::Type *> vTableMethodTys;
+        auto entryBlock = createBB("entry", releaseFn);
+        auto loopBlock = createBB("loop", releaseFn);
+        auto endBlock = createBB("end", releaseFn);
+
+        llvm::IRBuilder<> releaseBuilder(entryBlock);
+        auto chunks = releaseFn->getArg(0);
+        releaseBuilder.CreateCondBr(releaseBuilder.CreateIsNull(chunks), endBlock, loopBlock);
+
+        releaseBuilder.SetInsertPoint(loopBlock);
+        auto chunk = releaseBuilder.CreatePHI(bytePtrTy, 2, "chunk");
+        chunk->addIncoming(chunks, entryBlock);
+        auto next = releaseBuilder.CreateLoad(bytePtrTy, releaseBuilder.CreateBitCast(chunk, bytePtrTy->getPointerTo()),
+                                              "next");
+        releaseBuilder.CreateCall(module->getFunction("GC_free"), chunk);
+        chunk->addIncoming(next, loopBlock);
+        releaseBuilder.CreateCondBr(releaseBuilder.CreateIsNull(next), endBlock, loopBlock);
+
+        releaseBuilder.SetInsertPoint(endBlock);
+        releaseBuilder.CreateRetVoid();
+
+        return releaseFn;
+    }
+
+    /**
+     * (with-arena body...)
+     *
+     * Saves the enclosing arena, allocates a first chunk, evaluates the
+     * body as `begin`, then frees every chunk and restores the saved
+     * arena. The body's value is the value of the block.
+     */
+    llvm::Value *genWithArena(const Exp &exp, Env env)
+    {
+        if (isPreciseGC())
+        {
+            DIE << "[EvaLLVM]: with-arena is not supported with --gc=statepoint";
+        }
+
+        checkArenaEscapes(exp);
+
+        auto arena = getArena();
+        auto arenaTy = arena->getValueType();
 
-        for (auto &methodInfo : classMap_[className].methodsMap)
+        auto savedArena = builder->CreateLoad(arenaTy, arena, "arena.saved");
+        builder->CreateStore(llvm::Constant::getNullValue(arenaTy), arena);
+        builder->CreateCall(getArenaRefillFunction(), builder->getInt64(0));
+
+        auto blockEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
+
+        arenaDepth_++;
+        llvm::Value *blockRes = builder->getInt32(0);
+        for (auto i = 1; i < exp.list.size(); i++)
         {
-            auto method = methodInfo.second;
-            vTableMethods.push_back(method);
-            vTableMethodTys.push_back(method->getType());
+            blockRes = gen(exp.list[i], blockEnv);
         }
+        arenaDepth_--;
 
-        vTableTy->setBody(vTableMethodTys);
+        auto chunks = builder->CreateLoad(builder->getInt8PtrTy(),
+                                          builder->CreateStructGEP(arenaTy, arena, 2), "arena.chunks");
+        builder->CreateStore(savedArena, arena);
+        builder->CreateCall(getArenaReleaseFunction(), chunks);
 
-        auto vTableValue = llvm::ConstantStruct::get(vTableTy, vTableMethods);
-        createGlobalVar(vTableName, vTableValue);
+        return blockRes;
     }
 
-    bool isTaggedList(const Exp &exp, const std::string &tag)
+    /**
+     * Compile-time check of a `with-arena` block: instances allocated
+     * in it must not be stored into variables declared outside of it
+     * (including globals) or returned as the block's value.
+     */
+    void checkArenaEscapes(const Exp &exp)
     {
-        return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL &&
-               exp.list[0].string == tag;
+        std::set<std::string> declared;
+        std::set<std::string> regionNames;
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            checkArenaEscapes(exp.list[i], declared, regionNames);
+        }
+
+        if (exp.list.size() > 1 && isRegionValue(exp.list.back(), regionNames))
+        {
+            DIE << "[EvaLLVM]: with-arena returns an object allocated in the arena";
+        }
     }
 
-    bool isVar(const Exp &exp)
+    void checkArenaEscapes(const Exp &exp, std::set<std::string> &declared, std::set<std::string> &regionNames)
     {
-        return isTaggedList(exp, "var");
+        if (exp.type != ExpType::LIST || exp.list.empty() || isDef(exp) ||
+            isTaggedList(exp, "class") || isTaggedList(exp, "with-arena"))
+        {
+            return;
+        }
+
+        if (isVar(exp))
+        {
+            auto varName = extractVarName(exp.list[1]);
+            declared.insert(varName);
+            if (isRegionValue(exp.list[2], regionNames))
+            {
+                regionNames.insert(varName);
+            }
+        }
+
+        if (isTaggedList(exp, "set") && isRegionValue(exp.list[2], regionNames))
+        {
+            if (isTaggedList(exp.list[1], "index"))
+            {
+                DIE << "[EvaLLVM]: object allocated in with-arena is stored into an array, "
+                       "which outlives the arena";
+            }
+
+            auto &target = isProp(exp.list[1]) ? exp.list[1].list[1] : exp.list[1];
+            if (target.type == ExpType::SYMBOL && declared.count(target.string) == 0)
+            {
+                DIE << "[EvaLLVM]: object allocated in with-arena is stored into \""
+                    << target.string << "\", which outlives the arena";
+            }
+            if (!isProp(exp.list[1]))
+            {
+                regionNames.insert(target.string);
+            }
+        }
+
+        for (const auto &child : exp.list)
+        {
+            checkArenaEscapes(child, declared, regionNames);
+        }
     }
 
-    bool isDef(const Exp &exp)
+    bool isRegionValue(const Exp &exp, const std::set<std::string> &regionNames)
     {
-        return isTaggedList(exp, "def");
+        if (isTaggedList(exp, "lambda"))
+        {
+            for (const auto &name : regionNames)
+            {
+                if (mentions(exp, name))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+        return isNew(exp) || (exp.type == ExpType::SYMBOL && regionNames.count(exp.string) != 0);
     }
 
-    bool isNew(const Exp &exp)
+    bool mentions(const Exp &exp, const std::string &name)
     {
-        return isTaggedList(exp, "new");
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return exp.string == name;
+        }
+        for (const auto &child : exp.list)
+        {
+            if (mentions(child, name))
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    bool isProp(const Exp &exp)
+    bool containsTag(const Exp &exp, const std::string &tag)
     {
-        return isTaggedList(exp, "prop");
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return false;
+        }
+        if (isTaggedList(exp, tag))
+        {
+            return true;
+        }
+        for (const auto &child : exp.list)
+        {
+            if (containsTag(child, tag))
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    bool isSuper(const Exp &exp)
+    /**
+     * Pushes a batch of explicitly typed instances onto the (empty) free
+     * list of `cls` and pops the first one.
+     */
+    llvm::Function *getFreeListRefillFunction(llvm::StructType *cls)
     {
-        return isTaggedList(exp, "super");
+        auto refillName = "__eva_freelist_refill_" + cls->getName().str();
+
+        auto refillFn = module->getFunction(refillName);
+        if (refillFn != nullptr)
+        {
+            return refillFn;
+        }
+
+        auto bytePtrTy = builder->getInt8PtrTy();
+        refillFn = createRefillFunction(refillName, llvm::FunctionType::get(bytePtrTy, false));
+
+        auto freeList = getFreeList(cls);
+        auto linkOffset = getPointerOffsets(cls, false).front();
+        auto size = getTypeSize(cls);
+        auto batchCount = std::max<size_t>(FREE_LIST_BATCH_SIZE / size, 1);
+
+        auto entryBlock = &refillFn->getEntryBlock();
+        auto loopBlock = createBB("refill.loop", refillFn);
+        auto doneBlock = createBB("refill.done", refillFn);
+
+        llvm::IRBuilder<> refillBuilder(entryBlock);
+        addRoot(refillBuilder, freeList);
+        auto descr = refillBuilder.CreateLoad(refillBuilder.getInt64Ty(), getGCDescriptor(cls), "gcdescr");
+        refillBuilder.CreateBr(loopBlock);
+
+        refillBuilder.SetInsertPoint(loopBlock);
+        auto i = refillBuilder.CreatePHI(refillBuilder.getInt64Ty(), 2, "i");
+        i->addIncoming(refillBuilder.getInt64(0), entryBlock);
+        auto object = refillBuilder.CreateCall(module->getFunction("GC_malloc_explicitly_typed"),
+                                               {refillBuilder.getInt64(size), descr}, "object");
+        refillBuilder.CreateStore(refillBuilder.CreateLoad(bytePtrTy, freeList),
+                                  getFreeListLink(refillBuilder, object, linkOffset));
+        refillBuilder.CreateStore(object, freeList);
+        auto nextI = refillBuilder.CreateAdd(i, refillBuilder.getInt64(1), "i.next");
+        i->addIncoming(nextI, loopBlock);
+        refillBuilder.CreateCondBr(refillBuilder.CreateICmpULT(nextI, refillBuilder.getInt64(batchCount)),
+                                   loopBlock, doneBlock);
+
+        refillBuilder.SetInsertPoint(doneBlock);
+        auto head = refillBuilder.CreateLoad(bytePtrTy, freeList, "head");
+        refillBuilder.CreateStore(
+            refillBuilder.CreateLoad(bytePtrTy, getFreeListLink(refillBuilder, head, linkOffset)), freeList);
+        refillBuilder.CreateRet(head);
+
+        return refillFn;
     }
 
-    llvm::Value *mallocInstance(llvm::StructType *cls, const std::string &name)
+    /**
+     * `<Class>_gcMap`, the precise collector's object map:
+     * { i64 size, i64 count, [count x i64] offsets of object fields }.
+     */
+    llvm::GlobalVariable *getObjectMap(llvm::StructType *cls)
     {
-        auto typeSize = builder->getInt64(getTypeSize(cls));
-        auto mallocPtr = builder->CreateCall(module->getFunction("GC_malloc"), typeSize, name);
+        auto className = cls->getName().str();
 
-        auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+        auto objectMap = module->getNamedGlobal(className + "_gcMap");
+        if (objectMap != nullptr)
+        {
+            return objectMap;
+        }
 
-        std::string className{cls->getName().data()};
-        auto vTableName = className + "_vTable";
-        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
-        auto vTable = module->getNamedGlobal(vTableName);
-        builder->CreateStore(vTable, vTableAddr);
+        auto offsets = getPointerOffsets(cls, true);
 
-        return instance;
+        auto offsetsInit = llvm::ConstantDataArray::get(*ctx, offsets);
+        auto mapInit = llvm::ConstantStruct::getAnon(
+            {builder->getInt64(getTypeSize(cls)), builder->getInt64(offsets.size()), offsetsInit});
+
+        return new llvm::GlobalVariable(*module, mapInit->getType(), true,
+                                        llvm::GlobalValue::PrivateLinkage, mapInit,
+                                        className + "_gcMap");
     }
 
-    size_t getTypeSize(llvm::Type *type_)
+    /**
+     * `<array<T>>_gcMap`: an object map with ARRAY_MAP set in the count;
+     * size is the element size and the offsets are those within one
+     * element (see EvaGC.c).
+     */
+    llvm::GlobalVariable *getArrayMap(llvm::StructType *arrayTy)
     {
-        return module->getDataLayout().getTypeAllocSize(type_);
+        auto mapName = arrayTy->getName().str() + "_gcMap";
+
+        auto arrayMap = module->getNamedGlobal(mapName);
+        if (arrayMap != nullptr)
+        {
+            return arrayMap;
+        }
+
+        auto elemTy = getArrayElementType(arrayTy->getPointerTo());
+
+        std::vector<uint64_t> offsets;
+        collectPointerOffsets(elemTy, 0, true, offsets);
+
+        auto offsetsInit = llvm::ConstantDataArray::get(*ctx, offsets);
+        auto mapInit = llvm::ConstantStruct::getAnon(
+            {builder->getInt64(getTypeSize(elemTy)), builder->getInt64(ARRAY_MAP | offsets.size()), offsetsInit});
+
+        return new llvm::GlobalVariable(*module, mapInit->getType(), true,
+                                        llvm::GlobalValue::PrivateLinkage, mapInit, mapName);
+    }
+
+    bool isObjectPointer(llvm::Type *type_)
+    {
+        return type_->isPointerTy() && type_->getPointerAddressSpace() == GC_ADDRESS_SPACE;
+    }
+
+    bool hasPointerFields(llvm::StructType *cls)
+    {
+        return !getPointerOffsets(cls, false).empty();
+    }
+
+    bool containsObjectPointer(llvm::Type *type_)
+    {
+        std::vector<uint64_t> offsets;
+        collectPointerOffsets(type_, 0, true, offsets);
+        return !offsets.empty();
+    }
+
+    /**
+     * Offsets of the pointers in an instance, past the vtable pointer,
+     * including those inside struct-valued fields; `objectsOnly` keeps
+     * just the precise collector's object pointers.
+     */
+    std::vector<uint64_t> getPointerOffsets(llvm::StructType *cls, bool objectsOnly)
+    {
+        auto layout = module->getDataLayout().getStructLayout(cls);
+
+        std::vector<uint64_t> offsets;
+        for (auto i = RESERVED_FIELDS_COUNT; i < cls->getNumElements(); i++)
+        {
+            collectPointerOffsets(cls->getElementType(i), layout->getElementOffset(i), objectsOnly, offsets);
+        }
+        return offsets;
+    }
+
+    void collectPointerOffsets(llvm::Type *type_, uint64_t offset, bool objectsOnly, std::vector<uint64_t> &offsets)
+    {
+        if (auto structTy = llvm::dyn_cast<llvm::StructType>(type_))
+        {
+            auto layout = module->getDataLayout().getStructLayout(structTy);
+            for (auto i = 0; i < structTy->getNumElements(); i++)
+            {
+                collectPointerOffsets(structTy->getElementType(i), offset + layout->getElementOffset(i),
+                                      objectsOnly, offsets);
+            }
+        }
+        else if (objectsOnly ? isObjectPointer(type_) : type_->isPointerTy())
+        {
+            offsets.push_back(offset);
+        }
+    }
+
+    /**
+     * `<Class>_gcDescr`, set from the class's pointer bitmap by
+     * GC_make_descriptor in a module constructor.
+     */
+    llvm::GlobalVariable *getGCDescriptor(llvm::StructType *cls)
+    {
+        auto className = cls->getName().str();
+
+        auto descr = module->getNamedGlobal(className + "_gcDescr");
+        if (descr != nullptr)
+        {
+            return descr;
+        }
+
+        auto wordSize = module->getDataLayout().getPointerSize();
+        auto words = (getTypeSize(cls) + wordSize - 1) / wordSize;
+
+        std::vector<uint64_t> bitmap((words + 63) / 64, 0);
+        for (auto offset : getPointerOffsets(cls, false))
+        {
+            auto word = offset / wordSize;
+            bitmap[word / 64] |= uint64_t(1) << (word % 64);
+        }
+
+        auto bitmapInit = llvm::ConstantDataArray::get(*ctx, bitmap);
+        auto bitmapVar = new llvm::GlobalVariable(*module, bitmapInit->getType(), true,
+                                                  llvm::GlobalValue::PrivateLinkage, bitmapInit,
+                                                  className + "_gcBitmap");
+
+        descr = new llvm::GlobalVariable(*module, builder->getInt64Ty(), false,
+                                         llvm::GlobalValue::InternalLinkage, builder->getInt64(0),
+                                         className + "_gcDescr");
+
+        llvm::IRBuilder<> initBuilder(getGCInitFunction()->getEntryBlock().getTerminator());
+        auto bitmapPtr = initBuilder.CreateConstInBoundsGEP2_32(bitmapInit->getType(), bitmapVar, 0, 0);
+        initBuilder.CreateStore(
+            initBuilder.CreateCall(module->getFunction("GC_make_descriptor"),
+                                   {bitmapPtr, initBuilder.getInt64(words)}),
+            descr);
+
+        return descr;
+    }
+
+    llvm::Function *getGCInitFunction()
+    {
+        auto initFn = module->getFunction("__eva_gc_init");
+        if (initFn != nullptr)
+        {
+            return initFn;
+        }
+
+        initFn = llvm::Function::Create(llvm::FunctionType::get(builder->getVoidTy(), false),
+                                        llvm::Function::InternalLinkage, "__eva_gc_init", *module);
+
+        llvm::IRBuilder<> initBuilder(createBB("entry", initFn));
+        initBuilder.CreateCall(module->getFunction("GC_init"));
+        initBuilder.CreateRetVoid();
+
+        llvm::appendToGlobalCtors(*module, initFn, 0);
+        return initFn;
+    }
+
+    llvm::Value *allocaInstance(llvm::StructType *cls, const std::string &name)
+    {
+        auto instance = createEntryAlloca(cls, name + ".obj");
+        stackObjects_.insert(instance);
+
+        // Fields start zeroed, as with GC_malloc.
+        builder->CreateStore(llvm::Constant::getNullValue(cls), instance);
+        initVTable(cls, instance);
+
+        return instance;
     }
 
-    void inheritClass(llvm::StructType *cls, llvm::StructType *parent)
+    void initVTable(llvm::StructType *cls, llvm::Value *instance)
     {
-        auto parentClassInfo = &classMap_[parent->getName().data()];
+        auto vTable = getClassInfo(cls).vTable;
+        if (vTable == nullptr)
+        {
+            DIE << "[EvaLLVM]: class " << cls->getName().str() << " was not found to be instantiated";
+        }
+
+        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+        auto vTableStore = builder->CreateStore(vTable, vTableAddr);
+        vTableStore->setMetadata(llvm::LLVMContext::MD_invariant_group, llvm::MDNode::get(*ctx, {}));
+        vTableStore->setMetadata(llvm::LLVMContext::MD_tbaa, getTBAAAccessTag(cls, VTABLE_INDEX));
+    }
 
-        classMap_[cls->getName().data()] = {
-            cls, parent, parentClassInfo->fieldsMap, parentClassInfo->methodsMap};
+    size_t getTypeSize(llvm::Type *type_)
+    {
+        return module->getDataLayout().getTypeAllocSize(type_);
     }
 
-    llvm::StructType *getClassByName(const std::string &name)
+    /**
+     * Starts a subclass from its parent's fields and method slots.
+     */
+    void inheritClass(ClassInfo &classInfo, const ClassInfo &parent)
     {
-        return llvm::StructType::getTypeByName(*ctx, name);
+        classInfo.fieldTypes = parent.fieldTypes;
+        classInfo.methodOrder = parent.methodOrder;
+        classInfo.methodSlots = parent.methodSlots;
+        classInfo.methods = parent.methods;
+        classInfo.methodTypes = parent.methodTypes;
     }
 
     std::string extractVarName(const Exp &exp)
@@ -654,12 +3531,113 @@ private:
             return builder->getInt32Ty();
         }
 
+        if (type_ == "i64")
+        {
+            return builder->getInt64Ty();
+        }
+
+        if (type_ == "f64")
+        {
+            return builder->getDoubleTy();
+        }
+
         if (type_ == "string")
         {
             return builder->getInt8Ty()->getPointerTo();
         }
 
-        return classMap_[type_].cls->getPointerTo();
+        if (isClosureTypeName(type_))
+        {
+            return getClosureType(type_);
+        }
+
+        if (isArrayTypeName(type_))
+        {
+            return getArrayType(type_.substr(6, type_.size() - 7))->getPointerTo(objectAddressSpace());
+        }
+
+        if (isStructName(type_))
+        {
+            return structMap_[type_].type;
+        }
+
+        return getClassInfo(type_).cls->getPointerTo(objectAddressSpace());
+    }
+
+    /**
+     * Converts `value` to `type_` where the language allows it
+     * implicitly: between integer widths (sign-extending, booleans
+     * zero-extend), between integers and f64, and pointer bitcasts.
+     */
+    llvm::Value *castValue(llvm::Value *value, llvm::Type *type_)
+    {
+        auto valueTy = value->getType();
+
+        if (valueTy == type_)
+        {
+            return value;
+        }
+
+        if (valueTy->isIntegerTy() && type_->isIntegerTy())
+        {
+            return builder->CreateIntCast(value, type_, !valueTy->isIntegerTy(1));
+        }
+
+        if (valueTy->isIntegerTy() && type_->isFloatingPointTy())
+        {
+            return valueTy->isIntegerTy(1) ? builder->CreateUIToFP(value, type_)
+                                           : builder->CreateSIToFP(value, type_);
+        }
+
+        if (valueTy->isFloatingPointTy() && type_->isIntegerTy())
+        {
+            return builder->CreateFPToSI(value, type_);
+        }
+
+        if (valueTy->isFloatingPointTy() && type_->isFloatingPointTy())
+        {
+            return builder->CreateFPCast(value, type_);
+        }
+
+        // Constructors returning `self` from an untyped (number) def.
+        if (valueTy->isPointerTy() && type_->isIntegerTy())
+        {
+            return builder->CreatePtrToInt(value, type_);
+        }
+
+        return builder->CreateBitCast(value, type_);
+    }
+
+    /**
+     * Usual arithmetic conversions for a binary operator: an integer
+     * meeting an f64 becomes f64, a narrower integer is sign-extended.
+     */
+    void promoteOperands(llvm::Value *&op1, llvm::Value *&op2)
+    {
+        if (op1->getType() != op2->getType())
+        {
+            auto common = getCommonType(op1->getType(), op2->getType());
+            op1 = castValue(op1, common);
+            op2 = castValue(op2, common);
+        }
+    }
+
+    llvm::Type *getCommonType(llvm::Type *ty1, llvm::Type *ty2)
+    {
+        auto isNumeric = [](llvm::Type *type_)
+        { return type_->isIntegerTy() || type_->isFloatingPointTy(); };
+
+        if (!isNumeric(ty1) || !isNumeric(ty2))
+        {
+            DIE << "[EvaLLVM]: operands of incompatible types";
+        }
+
+        if (ty1->isFloatingPointTy() || ty2->isFloatingPointTy())
+        {
+            return builder->getDoubleTy();
+        }
+
+        return ty1->getIntegerBitWidth() >= ty2->getIntegerBitWidth() ? ty1 : ty2;
     }
 
     bool hasReturnType(const Exp &fnExp)
@@ -681,7 +3659,7 @@ private:
             auto paramTy = extractVarType(param);
 
             paramTypes.push_back(
-                paramName == "self" ? (llvm::Type *)cls->getPointerTo() : paramTy);
+                paramName == "self" ? (llvm::Type *)cls->getPointerTo(objectAddressSpace()) : paramTy);
         }
 
         return llvm::FunctionType::get(returnType, paramTypes, false);
@@ -694,6 +3672,15 @@ private:
 
         auto prevFn = fn;
         auto prevBlock = builder->GetInsertBlock();
+        auto prevFnBody = fnBody_;
+        fnBody_ = &body;
+        auto prevTailCalls = std::move(tailCalls_);
+        tailCalls_.clear();
+        collectTailCalls(body);
+        auto prevCaptures = std::move(captures_);
+        captures_.clear();
+        auto prevArenaDepth = arenaDepth_;
+        arenaDepth_ = 0;
 
         auto origName = fnName;
         if (cls != nullptr)
@@ -720,27 +3707,38 @@ private:
             builder->CreateStore(&arg, argBinding);
         }
 
-        builder->CreateRet(gen(body, fnEnv));
+        builder->CreateRet(castValue(gen(body, fnEnv), fn->getReturnType()));
         builder->SetInsertPoint(prevBlock);
         fn = prevFn;
+        fnBody_ = prevFnBody;
+        tailCalls_ = std::move(prevTailCalls);
+        captures_ = std::move(prevCaptures);
+        arenaDepth_ = prevArenaDepth;
         return newFn;
     }
 
     llvm::Value *allocVar(const std::string &name, llvm::Type *type_, Env env)
     {
-        varsBuilder->SetInsertPoint(&fn->getEntryBlock());
-        auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
+        auto varAlloc = createEntryAlloca(type_, name);
         env->define(name, varAlloc);
 
         return varAlloc;
     }
 
-    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init)
+    llvm::AllocaInst *createEntryAlloca(llvm::Type *type_, const std::string &name)
+    {
+        auto entry = &fn->getEntryBlock();
+        varsBuilder->SetInsertPoint(entry, entry->getFirstInsertionPt());
+        return varsBuilder->CreateAlloca(type_, 0, name.c_str());
+    }
+
+    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init,
+                                          bool isConstant = false)
     {
         module->getOrInsertGlobal(name, init->getType());
         auto variable = module->getNamedGlobal(name);
         variable->setAlignment(llvm::MaybeAlign(4));
-        variable->setConstant(false);
+        variable->setConstant(isConstant);
         variable->setInitializer(init);
         return variable;
     }
@@ -753,6 +3751,38 @@ private:
 
         module->getOrInsertFunction("GC_malloc",
                                     llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+
+        module->getOrInsertFunction("GC_malloc_atomic",
+                                    llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+
+        module->getOrInsertFunction("GC_malloc_explicitly_typed",
+                                    llvm::FunctionType::get(bytePtrTy, {builder->getInt64Ty(), builder->getInt64Ty()}, false));
+
+        module->getOrInsertFunction("GC_make_descriptor",
+                                    llvm::FunctionType::get(builder->getInt64Ty(), {builder->getInt64Ty()->getPointerTo(), builder->getInt64Ty()}, false));
+
+        module->getOrInsertFunction("GC_malloc_uncollectable",
+                                    llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+
+        module->getOrInsertFunction("GC_free",
+                                    llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false));
+
+        module->getOrInsertFunction("GC_add_roots",
+                                    llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, bytePtrTy}, false));
+
+        if (isPreciseGC())
+        {
+            auto gcPtrTy = builder->getInt8Ty()->getPointerTo(GC_ADDRESS_SPACE);
+
+            module->getOrInsertFunction("__eva_gc_alloc",
+                                        llvm::FunctionType::get(gcPtrTy, {builder->getInt64Ty(), bytePtrTy}, false));
+
+            module->getOrInsertFunction("__eva_gc_write_barrier",
+                                        llvm::FunctionType::get(builder->getVoidTy(), {gcPtrTy, gcPtrTy}, false));
+        }
+
+        module->getOrInsertFunction("GC_init",
+                                    llvm::FunctionType::get(builder->getVoidTy(), false));
     }
 
     llvm::Function *createFunction(const std::string &fnName, llvm::FunctionType *fnType, Env env)
@@ -766,6 +3796,11 @@ private:
 
         createFunctionBlock(fn);
 
+        if (options.instrumentCounters)
+        {
+            instrumentation->count(*builder, fnName);
+        }
+
         return fn;
     }
 
@@ -773,6 +3808,13 @@ private:
     {
         auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage, fnName, *module);
 
+        if (isPreciseGC())
+        {
+            // The collector walks Eva frames through the frame pointer chain.
+            fn->setGC(GC_STRATEGY);
+            fn->addFnAttr("frame-pointer", "all");
+        }
+
         verifyFunction(*fn);
 
         env->define(fnName, fn);
@@ -798,6 +3840,67 @@ private:
         module->print(outLL, nullptr);
     }
 
+    /**
+     * Optimizes the module at -O3 and writes it as an object file for
+     * the host, through a temporary so an interrupted build leaves no
+     * partial object behind.
+     */
+    void emitObject(const std::string &fileName)
+    {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+
+        auto triple = module->getTargetTriple();
+        std::string error;
+        auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+        if (target == nullptr)
+        {
+            DIE << "[EvaLLVM]: " << error;
+        }
+
+        std::unique_ptr<llvm::TargetMachine> targetMachine(target->createTargetMachine(
+            triple, llvm::sys::getHostCPUName(), "", llvm::TargetOptions(), llvm::Reloc::PIC_,
+            llvm::None, llvm::CodeGenOpt::Aggressive));
+        module->setDataLayout(targetMachine->createDataLayout());
+
+        llvm::PassBuilder passBuilder(targetMachine.get());
+
+        llvm::LoopAnalysisManager lam;
+        llvm::FunctionAnalysisManager fam;
+        llvm::CGSCCAnalysisManager cgam;
+        llvm::ModuleAnalysisManager mam;
+
+        passBuilder.registerModuleAnalyses(mam);
+        passBuilder.registerCGSCCAnalyses(cgam);
+        passBuilder.registerFunctionAnalyses(fam);
+        passBuilder.registerLoopAnalyses(lam);
+        passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
+
+        passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3).run(*module, mam);
+
+        auto tmpFileName = fileName + ".tmp";
+        {
+            std::error_code errorCode;
+            llvm::raw_fd_ostream out(tmpFileName, errorCode, llvm::sys::fs::OF_None);
+            if (errorCode)
+            {
+                DIE << "[EvaLLVM]: cannot write " << tmpFileName << ": " << errorCode.message();
+            }
+
+            llvm::legacy::PassManager codegen;
+            if (targetMachine->addPassesToEmitFile(codegen, out, nullptr, llvm::CGFT_ObjectFile))
+            {
+                DIE << "[EvaLLVM]: cannot emit objects for " << triple;
+            }
+            codegen.run(*module);
+        }
+
+        if (auto errorCode = llvm::sys::fs::rename(tmpFileName, fileName))
+        {
+            DIE << "[EvaLLVM]: cannot write " << fileName << ": " << errorCode.message();
+        }
+    }
+
     void moduleInit()
     {
         ctx = std::make_unique<llvm::LLVMContext>();
@@ -815,7 +3918,12 @@ private:
 
         for (auto &entry : globalObject)
         {
-            globalRec[entry.first] = createGlobalVar(entry.first, (llvm::Constant *)entry.second);
+            auto variable = createGlobalVar(entry.first, (llvm::Constant *)entry.second);
+            if (options.library)
+            {
+                variable->setLinkage(llvm::GlobalValue::InternalLinkage);
+            }
+            globalRec[entry.first] = variable;
         }
 
         GlobalEnv = std::make_shared<Environment>(globalRec, nullptr);
@@ -824,6 +3932,15 @@ private:
     void setupTargetTriple()
     {
         module->setTargetTriple("x86_64-pc-linux-gnu");
+        module->setDataLayout("e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128");
+    }
+
+    void setupInstrumentation()
+    {
+        if (options.instrumentCounters || options.instrumentAllocs || options.instrumentFields)
+        {
+            instrumentation = std::make_unique<Instrumentation>(*module, !isPreciseGC());
+        }
     }
 };
 
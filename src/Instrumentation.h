@@ -0,0 +1,266 @@
+#ifndef Instrumentation_h
+#define Instrumentation_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+/**
+ * Statistics compiled into the generated program.
+ *
+ * Each table is a global array of slots { i64 stats..., i8* name }:
+ *
+ *   __eva_counters: { count, name }          function entries, loop back-edges
+ *   __eva_allocs:   { count, bytes, class }  `new` per class
+ *
+ * Tables are sized once codegen is done, and a report sorted by the
+ * table's key column is printed to stderr when `main` returns.
+ */
+class Instrumentation
+{
+public:
+    Instrumentation(llvm::Module &module, bool reportGCHeap = true)
+        : module_(module), ctx_(module.getContext()), reportGCHeap_(reportGCHeap)
+    {
+        auto int64Ty = llvm::Type::getInt64Ty(ctx_);
+        auto bytePtrTy = llvm::Type::getInt8PtrTy(ctx_);
+
+        counters_ = {"__eva_counters",
+                     llvm::StructType::create(ctx_, {int64Ty, bytePtrTy}, "EvaCounter"),
+                     {"count"}, "counter", 0, nullptr, {}, {}};
+
+        allocs_ = {"__eva_allocs",
+                   llvm::StructType::create(ctx_, {int64Ty, int64Ty, bytePtrTy}, "EvaAllocStat"),
+                   {"allocs", "bytes"}, "class", 1, nullptr, {}, {}};
+    }
+
+    void count(llvm::IRBuilder<> &builder, const std::string &name)
+    {
+        auto slot = getSlot(builder, counters_, name);
+        increment(builder, counters_, slot, 0, builder.getInt64(1));
+    }
+
+    void countAllocation(llvm::IRBuilder<> &builder, const std::string &className, llvm::Value *size)
+    {
+        auto slot = getSlot(builder, allocs_, className);
+        increment(builder, allocs_, slot, 0, builder.getInt64(1));
+        increment(builder, allocs_, slot, 1, size);
+    }
+
+    /**
+     * Sizes the tables and emits the report calls at the
+     * current insertion point (the end of `main`).
+     */
+    void finalize(llvm::IRBuilder<> &builder)
+    {
+        if (finalizeTable(builder, counters_))
+        {
+            builder.CreateCall(createReportFunction(counters_));
+        }
+
+        if (finalizeTable(builder, allocs_))
+        {
+            builder.CreateCall(createReportFunction(allocs_));
+
+            if (reportGCHeap_)
+            {
+                auto int64Ty = builder.getInt64Ty();
+                auto heapSize = module_.getOrInsertFunction(
+                    "GC_get_heap_size", llvm::FunctionType::get(int64Ty, false));
+                auto gcCount = module_.getOrInsertFunction(
+                    "GC_get_gc_no", llvm::FunctionType::get(int64Ty, false));
+
+                builder.CreateCall(getFprintf(), {builder.CreateLoad(builder.getInt8PtrTy(), getStderr()),
+                                                  builder.CreateGlobalStringPtr("\nGC heap size: %lld bytes, collections: %lld\n"),
+                                                  builder.CreateCall(heapSize), builder.CreateCall(gcCount)});
+            }
+        }
+    }
+
+private:
+    struct Table
+    {
+        std::string name;
+        llvm::StructType *slotTy;
+        std::vector<std::string> columns;
+        std::string nameColumn;
+        unsigned sortColumn;
+
+        llvm::GlobalVariable *global = nullptr;
+        std::map<std::string, size_t> slotIndex;
+        std::vector<llvm::Constant *> slotNames;
+    };
+
+    size_t getSlot(llvm::IRBuilder<> &builder, Table &table, const std::string &name)
+    {
+        if (table.global == nullptr)
+        {
+            table.global = new llvm::GlobalVariable(module_, llvm::ArrayType::get(table.slotTy, 0), false,
+                                                    llvm::GlobalValue::ExternalLinkage, nullptr,
+                                                    table.name);
+        }
+
+        auto it = table.slotIndex.find(name);
+        if (it != table.slotIndex.end())
+        {
+            return it->second;
+        }
+
+        table.slotNames.push_back(builder.CreateGlobalStringPtr(name));
+        return table.slotIndex[name] = table.slotNames.size() - 1;
+    }
+
+    void increment(llvm::IRBuilder<> &builder, Table &table, size_t slot, unsigned column, llvm::Value *delta)
+    {
+        auto addr = builder.CreateConstInBoundsGEP2_32(
+            table.global->getValueType(), table.global, 0, slot, "pstat");
+        addr = builder.CreateStructGEP(table.slotTy, addr, column);
+
+        auto value = builder.CreateLoad(builder.getInt64Ty(), addr, "stat");
+        builder.CreateStore(builder.CreateAdd(value, delta), addr);
+    }
+
+    bool finalizeTable(llvm::IRBuilder<> &builder, Table &table)
+    {
+        if (table.global == nullptr)
+        {
+            return false;
+        }
+
+        std::vector<llvm::Constant *> slots;
+        for (auto name : table.slotNames)
+        {
+            std::vector<llvm::Constant *> fields(table.columns.size(), builder.getInt64(0));
+            fields.push_back(name);
+            slots.push_back(llvm::ConstantStruct::get(table.slotTy, fields));
+        }
+
+        auto tableTy = llvm::ArrayType::get(table.slotTy, slots.size());
+        auto global = new llvm::GlobalVariable(module_, tableTy, false,
+                                               llvm::GlobalValue::InternalLinkage,
+                                               llvm::ConstantArray::get(tableTy, slots));
+        global->takeName(table.global);
+        table.global->replaceAllUsesWith(llvm::ConstantExpr::getBitCast(global, table.global->getType()));
+        table.global->eraseFromParent();
+        table.global = global;
+
+        return true;
+    }
+
+    llvm::Function *createReportFunction(Table &table)
+    {
+        llvm::IRBuilder<> b(ctx_);
+
+        auto bytePtrTy = b.getInt8PtrTy();
+        auto int64Ty = b.getInt64Ty();
+        auto nameColumn = table.columns.size();
+
+        auto cmpTy = llvm::FunctionType::get(b.getInt32Ty(), {bytePtrTy, bytePtrTy}, false);
+        auto qsort = module_.getOrInsertFunction(
+            "qsort", llvm::FunctionType::get(b.getVoidTy(),
+                                             {bytePtrTy, int64Ty, int64Ty, cmpTy->getPointerTo()},
+                                             false));
+
+        // Descending by the sort column.
+        auto cmpFn = llvm::Function::Create(cmpTy, llvm::Function::InternalLinkage,
+                                            table.name + "_cmp", module_);
+        b.SetInsertPoint(llvm::BasicBlock::Create(ctx_, "entry", cmpFn));
+        auto lhs = b.CreateLoad(int64Ty, b.CreateStructGEP(table.slotTy,
+                                                           b.CreateBitCast(cmpFn->getArg(0), table.slotTy->getPointerTo()),
+                                                           table.sortColumn));
+        auto rhs = b.CreateLoad(int64Ty, b.CreateStructGEP(table.slotTy,
+                                                           b.CreateBitCast(cmpFn->getArg(1), table.slotTy->getPointerTo()),
+                                                           table.sortColumn));
+        b.CreateRet(b.CreateSub(b.CreateZExt(b.CreateICmpUGT(rhs, lhs), b.getInt32Ty()),
+                                b.CreateZExt(b.CreateICmpULT(rhs, lhs), b.getInt32Ty())));
+
+        auto reportFn = llvm::Function::Create(llvm::FunctionType::get(b.getVoidTy(), false),
+                                               llvm::Function::InternalLinkage,
+                                               table.name + "_report", module_);
+        auto entryBlock = llvm::BasicBlock::Create(ctx_, "entry", reportFn);
+        auto loopBlock = llvm::BasicBlock::Create(ctx_, "loop", reportFn);
+        auto printBlock = llvm::BasicBlock::Create(ctx_, "print", reportFn);
+        auto nextBlock = llvm::BasicBlock::Create(ctx_, "next", reportFn);
+        auto endBlock = llvm::BasicBlock::Create(ctx_, "end", reportFn);
+
+        auto size = b.getInt64(table.slotNames.size());
+
+        std::string headerFormat = "\n";
+        std::string rowFormat;
+        for (size_t i = 0; i < nameColumn; i++)
+        {
+            headerFormat += "%14s";
+            rowFormat += "%14lld";
+        }
+        headerFormat += "  %s\n";
+        rowFormat += "  %s\n";
+
+        b.SetInsertPoint(entryBlock);
+        auto out = b.CreateLoad(bytePtrTy, getStderr(), "stderr");
+        b.CreateCall(qsort, {b.CreateBitCast(table.global, bytePtrTy), size,
+                             b.getInt64(module_.getDataLayout().getTypeAllocSize(table.slotTy)),
+                             cmpFn});
+
+        std::vector<llvm::Value *> headerArgs{out, b.CreateGlobalStringPtr(headerFormat)};
+        for (const auto &column : table.columns)
+        {
+            headerArgs.push_back(b.CreateGlobalStringPtr(column));
+        }
+        headerArgs.push_back(b.CreateGlobalStringPtr(table.nameColumn));
+        b.CreateCall(getFprintf(), headerArgs);
+        b.CreateCondBr(b.CreateICmpEQ(size, b.getInt64(0)), endBlock, loopBlock);
+
+        b.SetInsertPoint(loopBlock);
+        auto idx = b.CreatePHI(int64Ty, 2, "idx");
+        idx->addIncoming(b.getInt64(0), entryBlock);
+        auto slot = b.CreateInBoundsGEP(table.global->getValueType(), table.global, {b.getInt64(0), idx});
+        auto first = b.CreateLoad(int64Ty, b.CreateStructGEP(table.slotTy, slot, 0), "first");
+        b.CreateCondBr(b.CreateICmpEQ(first, b.getInt64(0)), nextBlock, printBlock);
+
+        b.SetInsertPoint(printBlock);
+        std::vector<llvm::Value *> rowArgs{out, b.CreateGlobalStringPtr(rowFormat)};
+        for (size_t i = 0; i < nameColumn; i++)
+        {
+            rowArgs.push_back(b.CreateLoad(int64Ty, b.CreateStructGEP(table.slotTy, slot, i)));
+        }
+        rowArgs.push_back(b.CreateLoad(bytePtrTy, b.CreateStructGEP(table.slotTy, slot, nameColumn)));
+        b.CreateCall(getFprintf(), rowArgs);
+        b.CreateBr(nextBlock);
+
+        b.SetInsertPoint(nextBlock);
+        auto nextIdx = b.CreateAdd(idx, b.getInt64(1));
+        idx->addIncoming(nextIdx, nextBlock);
+        b.CreateCondBr(b.CreateICmpULT(nextIdx, size), loopBlock, endBlock);
+
+        b.SetInsertPoint(endBlock);
+        b.CreateRetVoid();
+
+        return reportFn;
+    }
+
+    llvm::FunctionCallee getFprintf()
+    {
+        auto bytePtrTy = llvm::Type::getInt8PtrTy(ctx_);
+        return module_.getOrInsertFunction(
+            "fprintf", llvm::FunctionType::get(llvm::Type::getInt32Ty(ctx_), {bytePtrTy, bytePtrTy}, true));
+    }
+
+    llvm::Constant *getStderr()
+    {
+        return module_.getOrInsertGlobal("stderr", llvm::Type::getInt8PtrTy(ctx_));
+    }
+
+    llvm::Module &module_;
+
+    llvm::LLVMContext &ctx_;
+
+    bool reportGCHeap_;
+
+    Table counters_;
+
+    Table allocs_;
+};
+
+#endif
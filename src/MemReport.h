@@ -0,0 +1,114 @@
+#ifndef MemReport_h
+#define MemReport_h
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/**
+ * Heap allocations made through operator new (see eva-llvm.cpp).
+ */
+struct AllocCounter
+{
+    size_t count;
+    size_t bytes;
+};
+
+inline AllocCounter &allocCounter()
+{
+    static AllocCounter counter{0, 0};
+    return counter;
+}
+
+/**
+ * Compiler memory usage sampled at phase boundaries.
+ */
+class MemReport
+{
+public:
+    static MemReport &get()
+    {
+        static MemReport report;
+        return report;
+    }
+
+    void phase(const std::string &name)
+    {
+        auto &counter = allocCounter();
+        auto rss = residentBytes();
+        phases_.push_back({name, rss, std::max(rss, peakResidentBytes()),
+                           counter.count - lastCount_, counter.bytes - lastBytes_});
+        lastCount_ = counter.count;
+        lastBytes_ = counter.bytes;
+    }
+
+    void stat(const std::string &name, size_t value)
+    {
+        stats_.push_back({name, value});
+    }
+
+    void print()
+    {
+        std::fprintf(stderr, "\n%-10s %12s %12s %12s %14s\n",
+                     "phase", "rss KiB", "peak KiB", "allocs", "alloc bytes");
+        for (const auto &phase : phases_)
+        {
+            std::fprintf(stderr, "%-10s %12zu %12zu %12zu %14zu\n", phase.name.c_str(),
+                         phase.rss / 1024, phase.peakRss / 1024, phase.allocs, phase.allocBytes);
+        }
+
+        std::fprintf(stderr, "\n");
+        for (const auto &stat : stats_)
+        {
+            std::fprintf(stderr, "%-24s %12zu\n", stat.first.c_str(), stat.second);
+        }
+    }
+
+private:
+    struct Phase
+    {
+        std::string name;
+        size_t rss;
+        size_t peakRss;
+        size_t allocs;
+        size_t allocBytes;
+    };
+
+    MemReport() = default;
+
+    size_t residentBytes()
+    {
+        size_t size = 0, resident = 0;
+        auto statm = std::fopen("/proc/self/statm", "r");
+        if (statm != nullptr)
+        {
+            if (std::fscanf(statm, "%zu %zu", &size, &resident) != 2)
+            {
+                resident = 0;
+            }
+            std::fclose(statm);
+        }
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    size_t peakResidentBytes()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss * 1024;
+    }
+
+    std::vector<Phase> phases_;
+
+    std::vector<std::pair<std::string, size_t>> stats_;
+
+    size_t lastCount_ = 0;
+
+    size_t lastBytes_ = 0;
+};
+
+#endif
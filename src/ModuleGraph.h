@@ -0,0 +1,248 @@
+#ifndef ModuleGraph_h
+#define ModuleGraph_h
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/xxhash.h>
+
+#include "./Logger.h"
+#include "./parser/EvaParser.h"
+
+/**
+ * One source file of a program.
+ */
+struct ModuleInfo
+{
+    std::string path;
+    std::string source;
+    Exp ast;
+
+    /**
+     * Direct imports, as indices into ModuleGraph::modules().
+     */
+    std::vector<size_t> imports;
+
+    /**
+     * Content hash of the file and, through their keys, of everything
+     * it imports: a module must be recompiled when its key changes.
+     */
+    uint64_t key = 0;
+};
+
+/**
+ * The files reachable through top-level `(import "file")` forms, which
+ * are resolved relative to the importing file. Imported files may only
+ * hold definitions: def, class, struct, and vars bound to literals or
+ * comptime expressions.
+ */
+class ModuleGraph
+{
+public:
+    ModuleGraph(syntax::EvaParser &parser) : parser_(parser) {}
+
+    /**
+     * Loads the main module, read from `path` ("" for an expression),
+     * and everything it imports.
+     */
+    void load(const std::string &path, const std::string &source)
+    {
+        llvm::SmallString<256> realPath;
+        if (!path.empty() && !llvm::sys::fs::real_path(path, realPath))
+        {
+            loading_.push_back(realPath.str().str());
+        }
+        addModule(path, source, false);
+    }
+
+    /**
+     * Modules in dependency order: each one after all it imports, the
+     * main module last.
+     */
+    const std::vector<ModuleInfo> &modules()
+    {
+        return modules_;
+    }
+
+    /**
+     * Every module `index` imports directly or indirectly, in
+     * dependency order.
+     */
+    std::vector<size_t> dependencies(size_t index)
+    {
+        std::vector<bool> seen(modules_.size(), false);
+        collectDependencies(index, seen);
+
+        std::vector<size_t> deps;
+        for (size_t i = 0; i < index; i++)
+        {
+            if (seen[i])
+            {
+                deps.push_back(i);
+            }
+        }
+        return deps;
+    }
+
+    /**
+     * The whole program as one `(begin ...)`: every module's forms, in
+     * dependency order, without the imports.
+     */
+    Exp program()
+    {
+        std::vector<Exp> forms{modules_.back().ast.list[0]};
+        for (const auto &module : modules_)
+        {
+            for (auto i = 1; i < module.ast.list.size(); i++)
+            {
+                if (!isImport(module.ast.list[i]))
+                {
+                    forms.push_back(module.ast.list[i]);
+                }
+            }
+        }
+        return Exp(forms);
+    }
+
+    /**
+     * Derives every module's key; `salt` covers the compiler and the
+     * options that affect the generated code.
+     */
+    void computeKeys(const std::string &salt)
+    {
+        for (auto &module : modules_)
+        {
+            auto input = salt + '\0' + module.source;
+            for (auto dep : module.imports)
+            {
+                input += '\0' + std::to_string(modules_[dep].key);
+            }
+            module.key = llvm::xxHash64(input);
+        }
+    }
+
+private:
+    size_t addModule(const std::string &path, const std::string &source, bool imported)
+    {
+        auto ast = parser_.parse("(begin " + source + ")");
+
+        std::vector<size_t> imports;
+        for (auto i = 1; i < ast.list.size(); i++)
+        {
+            auto &form = ast.list[i];
+            if (isImport(form))
+            {
+                imports.push_back(importModule(path, form));
+            }
+            else if (imported && !isDefinition(form))
+            {
+                DIE << "[ModuleGraph]: " << path << ": imported files may only contain definitions";
+            }
+        }
+
+        modules_.push_back({path, source, ast, imports});
+        return modules_.size() - 1;
+    }
+
+    size_t importModule(const std::string &importerPath, const Exp &importExp)
+    {
+        if (importExp.list.size() != 2 || importExp.list[1].type != ExpType::STRING)
+        {
+            DIE << "[ModuleGraph]: import takes a file name string";
+        }
+
+        llvm::SmallString<256> path(llvm::sys::path::parent_path(importerPath));
+        llvm::sys::path::append(path, importExp.list[1].string);
+
+        llvm::SmallString<256> realPath;
+        if (llvm::sys::fs::real_path(path, realPath))
+        {
+            DIE << "[ModuleGraph]: cannot find " << path.str().str();
+        }
+
+        auto key = realPath.str().str();
+        auto loaded = loaded_.find(key);
+        if (loaded != loaded_.end())
+        {
+            return loaded->second;
+        }
+
+        for (const auto &loading : loading_)
+        {
+            if (loading == key)
+            {
+                DIE << "[ModuleGraph]: import cycle through " << path.str().str();
+            }
+        }
+
+        std::ifstream file(key);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+
+        loading_.push_back(key);
+        auto index = addModule(path.str().str(), buffer.str(), true);
+        loading_.pop_back();
+
+        loaded_[key] = index;
+        return index;
+    }
+
+    void collectDependencies(size_t index, std::vector<bool> &seen)
+    {
+        for (auto dep : modules_[index].imports)
+        {
+            if (!seen[dep])
+            {
+                seen[dep] = true;
+                collectDependencies(dep, seen);
+            }
+        }
+    }
+
+    bool isDefinition(const Exp &exp)
+    {
+        if (isTagged(exp, "def") || isTagged(exp, "class") || isTagged(exp, "struct"))
+        {
+            return true;
+        }
+
+        if (!isTagged(exp, "var") || exp.list.size() != 3)
+        {
+            return false;
+        }
+
+        auto &init = exp.list[2];
+        return init.type == ExpType::NUMBER || init.type == ExpType::FLOAT ||
+               init.type == ExpType::STRING || isTagged(init, "comptime") ||
+               (init.type == ExpType::SYMBOL && (init.string == "true" || init.string == "false"));
+    }
+
+    bool isImport(const Exp &exp)
+    {
+        return isTagged(exp, "import");
+    }
+
+    bool isTagged(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    syntax::EvaParser &parser_;
+
+    std::vector<ModuleInfo> modules_;
+
+    /**
+     * Real paths of loaded modules, and of those being loaded.
+     */
+    std::map<std::string, size_t> loaded_;
+
+    std::vector<std::string> loading_;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef Reachability_h
+#define Reachability_h
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./ClassHierarchy.h"
+#include "./parser/EvaParser.h"
+
+/**
+ * Rapid type analysis over the AST: the functions, classes and methods
+ * reachable from the top-level program.
+ *
+ * A class is instantiated if reachable code contains `(new Class ...)`,
+ * and a method name is dispatched if reachable code contains
+ * `(method x name)`. A method body is reachable when some instantiated
+ * class resolves a dispatched name to it, or through `super`.
+ *
+ * Generic templates are analyzed once for all their instances. Until
+ * analyze() runs, as in separate compilation, everything is live.
+ */
+class Reachability
+{
+public:
+    Reachability(ClassHierarchy &classHierarchy) : classHierarchy_(classHierarchy) {}
+
+    void analyze(const Exp &program)
+    {
+        analyzed_ = true;
+        collect(program, "");
+
+        // Constructors are called by `new`, `__call__` by calling an
+        // instance; neither is spelled as a `method` form.
+        dispatch("constructor");
+        dispatch("__call__");
+
+        for (auto i = 1; i < program.list.size(); i++)
+        {
+            visit(program.list[i]);
+        }
+
+        while (!worklist_.empty())
+        {
+            auto body = worklist_.back();
+            worklist_.pop_back();
+            visit(*body);
+        }
+    }
+
+    /**
+     * Whether a def named `fnName` outside classes may be called.
+     */
+    bool isFunctionLive(const std::string &fnName)
+    {
+        return !analyzed_ || functions_.count(fnName) == 0 || reached_.count(fnName) != 0;
+    }
+
+    bool isInstantiated(const std::string &className)
+    {
+        return !analyzed_ || isGeneric(className) || instantiated_.count(className) != 0;
+    }
+
+    /**
+     * Whether `methodName` can be called on some object; only these
+     * names get vtable slots.
+     */
+    bool isDispatched(const std::string &methodName)
+    {
+        return !analyzed_ || dispatched_.count(methodName) != 0;
+    }
+
+    bool isMethodLive(const std::string &className, const std::string &methodName)
+    {
+        if (!analyzed_ || isGeneric(className))
+        {
+            return isDispatched(methodName);
+        }
+        return reached_.count(className + "_" + methodName) != 0;
+    }
+
+private:
+    void collect(const Exp &exp, const std::string &className)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        if (isTagged(exp, "class") && exp.list.size() == 4)
+        {
+            auto &name = exp.list[1].string;
+            if (isGeneric(name))
+            {
+                genericClasses_[baseName(name)] = name;
+            }
+            for (const auto &member : exp.list[3].list)
+            {
+                collect(member, name);
+            }
+            return;
+        }
+
+        if (isTagged(exp, "def"))
+        {
+            auto &name = exp.list[1].string;
+            if (!className.empty())
+            {
+                functions_[className + "_" + name].push_back(&exp.list.back());
+                return;
+            }
+
+            functions_[isGeneric(name) ? baseName(name) + "<>" : name].push_back(&exp.list.back());
+        }
+
+        for (const auto &child : exp.list)
+        {
+            collect(child, className);
+        }
+    }
+
+    void visit(const Exp &exp)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            reach(isGeneric(exp.string) ? baseName(exp.string) + "<>" : exp.string);
+            return;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        // Reached by name.
+        if (isTagged(exp, "def") || isTagged(exp, "class") || isTagged(exp, "struct"))
+        {
+            return;
+        }
+
+        if (isTagged(exp, "new"))
+        {
+            instantiate(exp.list[1].string);
+            visitFrom(exp, 2);
+            return;
+        }
+
+        if (isTagged(exp, "method"))
+        {
+            auto &methodName = exp.list[2].string;
+            if (isTagged(exp.list[1], "super"))
+            {
+                auto parentName = classHierarchy_.parentOf(templateName(exp.list[1].list[1].string));
+                dispatch(methodName);
+                reachMethod(parentName, methodName);
+                return;
+            }
+            dispatch(methodName);
+            visit(exp.list[1]);
+            return;
+        }
+
+        if (isTagged(exp, "prop"))
+        {
+            visit(exp.list[1]);
+            return;
+        }
+
+        if (isTagged(exp, "var"))
+        {
+            visit(exp.list[2]);
+            return;
+        }
+
+        if (isTagged(exp, "lambda"))
+        {
+            visit(exp.list.back());
+            return;
+        }
+
+        visitFrom(exp, 0);
+    }
+
+    void visitFrom(const Exp &exp, size_t first)
+    {
+        for (auto i = first; i < exp.list.size(); i++)
+        {
+            visit(exp.list[i]);
+        }
+    }
+
+    void reach(const std::string &fnName)
+    {
+        auto fn = functions_.find(fnName);
+        if (fn == functions_.end() || !reached_.insert(fnName).second)
+        {
+            return;
+        }
+        for (auto body : fn->second)
+        {
+            worklist_.push_back(body);
+        }
+    }
+
+    /**
+     * The body `methodName` resolves to for instances of `className`.
+     */
+    void reachMethod(const std::string &className, const std::string &methodName)
+    {
+        auto impl = classHierarchy_.resolve(className, methodName);
+        if (!impl.empty())
+        {
+            reach(impl + "_" + methodName);
+        }
+    }
+
+    void instantiate(const std::string &name)
+    {
+        auto className = templateName(name);
+        if (!instantiated_.insert(className).second)
+        {
+            return;
+        }
+
+        for (const auto &methodName : dispatched_)
+        {
+            reachMethod(className, methodName);
+        }
+    }
+
+    void dispatch(const std::string &methodName)
+    {
+        if (!dispatched_.insert(methodName).second)
+        {
+            return;
+        }
+
+        for (const auto &className : instantiated_)
+        {
+            reachMethod(className, methodName);
+        }
+    }
+
+    /**
+     * `Box<number>` -> `Box<T>`, the name the class hierarchy knows.
+     */
+    std::string templateName(const std::string &className)
+    {
+        if (!isGeneric(className))
+        {
+            return className;
+        }
+        auto it = genericClasses_.find(baseName(className));
+        return it == genericClasses_.end() ? className : it->second;
+    }
+
+    bool isGeneric(const std::string &name)
+    {
+        auto open = name.find('<');
+        return open != std::string::npos && open > 0 && name.back() == '>' &&
+               name.compare(0, 6, "array<") != 0 && name.compare(0, 3, "fn<") != 0;
+    }
+
+    std::string baseName(const std::string &name)
+    {
+        return name.substr(0, name.find('<'));
+    }
+
+    bool isTagged(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    ClassHierarchy &classHierarchy_;
+
+    bool analyzed_ = false;
+
+    /**
+     * Bodies of functions (by name) and methods (by `Class_method`);
+     * generic functions are keyed `name<>`.
+     */
+    std::map<std::string, std::vector<const Exp *>> functions_;
+
+    std::map<std::string, std::string> genericClasses_;
+
+    std::set<std::string> reached_;
+
+    std::set<std::string> instantiated_;
+
+    std::set<std::string> dispatched_;
+
+    std::vector<const Exp *> worklist_;
+};
+
+#endif
@@ -50,11 +50,14 @@
 //   }
 //
 // clang-format off
+#include <cctype>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 enum class ExpType {
     NUMBER,
+    FLOAT,
     STRING,
     SYMBOL,
     LIST,
@@ -63,16 +66,25 @@ enum class ExpType {
 struct Exp {
     ExpType type;
 
-    int number;
+    int64_t number;
+    double floatNumber;
     std::string string;
     std::vector<Exp> list;
 
-    Exp(int number) : type(ExpType::NUMBER), number(number) {}
+    Exp(int64_t number) : type(ExpType::NUMBER), number(number) {}
 
     Exp(std::string& strVal) {
         if (strVal[0] == '"'){
             type = ExpType::STRING;
             string = strVal.substr(1, strVal.size() - 2);
+        } else if (std::isdigit(strVal[0])) {
+            if (strVal.find('.') != std::string::npos) {
+                type = ExpType::FLOAT;
+                floatNumber = std::stod(strVal);
+            } else {
+                type = ExpType::NUMBER;
+                number = std::stoll(strVal);
+            }
         } else {
             type = ExpType::SYMBOL;
             string = strVal;
@@ -439,7 +451,7 @@ std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
   {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
   {std::regex(R"(^\s+)"), &_lexRule5},
   {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
+  {std::regex(R"(^\d+(\.\d+)?)"), &_lexRule7},
   {std::regex(R"(^[\w\-+*=<>/:,]+)"), &_lexRule8}
 }};
 std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
@@ -693,7 +705,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -0,0 +1,640 @@
+/**
+ * Precise generational collector for `eva-llvm --gc=statepoint`.
+ *
+ * New objects are bump-allocated in a fixed nursery. A minor collection
+ * copies the survivors into the old generation (promotion on first
+ * survival) and resets the nursery; old objects are non-moving and
+ * reclaimed by mark-sweep once the old generation has doubled.
+ *
+ * Roots are found precisely: every Eva function is compiled with frame
+ * pointers and its calls are rewritten into gc.statepoints, so walking
+ * the frame chain and looking up each return address in the
+ * .llvm_stackmaps section yields the stack slots of all live objects.
+ *
+ * Each object is preceded by a header word pointing to its object map
+ * (size and offsets of pointer fields, emitted per class by the
+ * compiler); while copying, the header holds the forwarding address.
+ * Arrays set ARRAY_MAP in the map's count: their size is then the
+ * element size, the offsets are within one element, and the length is
+ * the array's first word.
+ *
+ * Build: cc -O2 -fno-omit-frame-pointer -c src/runtime/EvaGC.c
+ */
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NURSERY_SIZE (4 * 1024 * 1024)
+
+#define LARGE_OBJECT_SIZE (NURSERY_SIZE / 8)
+
+#define MIN_MAJOR_THRESHOLD (16 * 1024 * 1024)
+
+#define FORWARDED 1
+
+#define ARRAY_MAP ((uint64_t)1 << 63)
+
+#define ARRAY_HEADER_SIZE 8
+
+#define DWARF_RBP 6
+
+#define DWARF_RSP 7
+
+typedef struct EvaObjectMap
+{
+    uint64_t size;
+    uint64_t count;
+    uint64_t offsets[];
+} EvaObjectMap;
+
+typedef struct Header
+{
+    uintptr_t map;
+} Header;
+
+typedef struct OldHeader
+{
+    struct OldHeader *next;
+    uint32_t marked;
+    uint32_t remembered;
+    Header header;
+} OldHeader;
+
+typedef struct Location
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t size;
+    uint16_t reg;
+    uint16_t reserved2;
+    int32_t offset;
+} Location;
+
+enum
+{
+    LOCATION_REGISTER = 1,
+    LOCATION_DIRECT = 2,
+    LOCATION_INDIRECT = 3,
+    LOCATION_CONSTANT = 4,
+    LOCATION_CONSTANT_INDEX = 5,
+};
+
+typedef struct Safepoint
+{
+    uintptr_t returnAddress;
+    const Location *locations;
+    uint16_t count;
+} Safepoint;
+
+typedef struct Stack
+{
+    void **items;
+    size_t size;
+    size_t capacity;
+} Stack;
+
+static char *nurseryStart, *nurseryCur, *nurseryEnd;
+
+static OldHeader *oldObjects;
+
+static size_t oldBytes;
+
+static size_t majorThreshold = MIN_MAJOR_THRESHOLD;
+
+static Stack gray, remembered;
+
+static Safepoint *safepoints;
+
+static size_t safepointMask;
+
+static struct
+{
+    size_t minor, major;
+    uint64_t minorNanos, maxMinorNanos, majorNanos;
+    size_t promotedBytes;
+} stats;
+
+__attribute__((noreturn)) static void fatal(const char *message)
+{
+    fprintf(stderr, "Fatal error: [EvaGC]: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+static void push(Stack *stack, void *item)
+{
+    if (stack->size == stack->capacity)
+    {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 1024;
+        stack->items = realloc(stack->items, stack->capacity * sizeof(void *));
+        if (stack->items == NULL)
+        {
+            fatal("out of memory");
+        }
+    }
+    stack->items[stack->size++] = item;
+}
+
+static uint64_t nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int inNursery(const void *ptr)
+{
+    return (const char *)ptr >= nurseryStart && (const char *)ptr < nurseryEnd;
+}
+
+static Header *headerOf(void *obj)
+{
+    return (Header *)obj - 1;
+}
+
+static OldHeader *oldHeaderOf(void *obj)
+{
+    return (OldHeader *)((char *)obj - offsetof(OldHeader, header) - sizeof(Header));
+}
+
+static const EvaObjectMap *mapOf(void *obj)
+{
+    return (const EvaObjectMap *)headerOf(obj)->map;
+}
+
+static uint64_t objectSize(const void *obj, const EvaObjectMap *map)
+{
+    if (map->count & ARRAY_MAP)
+    {
+        return ARRAY_HEADER_SIZE + *(const uint64_t *)obj * map->size;
+    }
+    return map->size;
+}
+
+/* -- Stack maps ------------------------------------------------------ */
+
+static int findMainObject(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void)size;
+    *(uintptr_t *)data = info->dlpi_addr;
+    return 1;
+}
+
+/**
+ * The linker keeps .llvm_stackmaps but exports no symbol for it, so it
+ * is located through the executable's section headers.
+ */
+static const uint8_t *findStackMaps(void)
+{
+    FILE *exe = fopen("/proc/self/exe", "rb");
+    if (exe == NULL)
+    {
+        return NULL;
+    }
+
+    const uint8_t *stackMaps = NULL;
+
+    Elf64_Ehdr ehdr;
+    Elf64_Shdr *shdrs = NULL;
+    char *names = NULL;
+
+    if (fread(&ehdr, sizeof(ehdr), 1, exe) != 1)
+    {
+        goto done;
+    }
+
+    shdrs = calloc(ehdr.e_shnum, sizeof(Elf64_Shdr));
+    if (fseek(exe, ehdr.e_shoff, SEEK_SET) != 0 ||
+        fread(shdrs, sizeof(Elf64_Shdr), ehdr.e_shnum, exe) != ehdr.e_shnum)
+    {
+        goto done;
+    }
+
+    Elf64_Shdr *strtab = &shdrs[ehdr.e_shstrndx];
+    names = malloc(strtab->sh_size);
+    if (fseek(exe, strtab->sh_offset, SEEK_SET) != 0 ||
+        fread(names, 1, strtab->sh_size, exe) != strtab->sh_size)
+    {
+        goto done;
+    }
+
+    for (int i = 0; i < ehdr.e_shnum; i++)
+    {
+        if (strcmp(names + shdrs[i].sh_name, ".llvm_stackmaps") == 0)
+        {
+            uintptr_t loadBias = 0;
+            dl_iterate_phdr(findMainObject, &loadBias);
+            stackMaps = (const uint8_t *)(loadBias + shdrs[i].sh_addr);
+            break;
+        }
+    }
+
+done:
+    free(names);
+    free(shdrs);
+    fclose(exe);
+    return stackMaps;
+}
+
+static size_t hashAddress(uintptr_t address)
+{
+    return (address * 0x9E3779B97F4A7C15ull) >> 17;
+}
+
+static void addSafepoint(uintptr_t returnAddress, const Location *locations, uint16_t count)
+{
+    size_t i = hashAddress(returnAddress) & safepointMask;
+    while (safepoints[i].returnAddress != 0)
+    {
+        i = (i + 1) & safepointMask;
+    }
+    safepoints[i] = (Safepoint){returnAddress, locations, count};
+}
+
+static const Safepoint *findSafepoint(uintptr_t returnAddress)
+{
+    size_t i = hashAddress(returnAddress) & safepointMask;
+    while (safepoints[i].returnAddress != 0)
+    {
+        if (safepoints[i].returnAddress == returnAddress)
+        {
+            return &safepoints[i];
+        }
+        i = (i + 1) & safepointMask;
+    }
+    return NULL;
+}
+
+static const uint8_t *align8(const uint8_t *ptr)
+{
+    return (const uint8_t *)(((uintptr_t)ptr + 7) & ~(uintptr_t)7);
+}
+
+/**
+ * Stack map format v3: header, functions { addr, stack size, record
+ * count }, constants, then the records of each function in order.
+ */
+static void loadStackMaps(void)
+{
+    const uint8_t *stackMaps = findStackMaps();
+    if (stackMaps == NULL || stackMaps[0] != 3)
+    {
+        fatal("no .llvm_stackmaps (version 3) section in the executable");
+    }
+
+    uint32_t numFunctions = *(const uint32_t *)(stackMaps + 4);
+    uint32_t numConstants = *(const uint32_t *)(stackMaps + 8);
+    uint32_t numRecords = *(const uint32_t *)(stackMaps + 12);
+
+    size_t capacity = 16;
+    while (capacity < numRecords * 2)
+    {
+        capacity *= 2;
+    }
+    safepoints = calloc(capacity, sizeof(Safepoint));
+    safepointMask = capacity - 1;
+
+    const uint64_t *functions = (const uint64_t *)(stackMaps + 16);
+    const uint8_t *record = stackMaps + 16 + numFunctions * 24 + numConstants * 8;
+
+    for (uint32_t fn = 0; fn < numFunctions; fn++)
+    {
+        uint64_t address = functions[fn * 3];
+        uint64_t recordCount = functions[fn * 3 + 2];
+
+        for (uint64_t r = 0; r < recordCount; r++)
+        {
+            uint32_t instructionOffset = *(const uint32_t *)(record + 8);
+            uint16_t numLocations = *(const uint16_t *)(record + 14);
+            const Location *locations = (const Location *)(record + 16);
+
+            addSafepoint(address + instructionOffset, locations, numLocations);
+
+            record = align8(record + 16 + numLocations * sizeof(Location));
+            uint16_t numLiveOuts = *(const uint16_t *)(record + 2);
+            record = align8(record + 4 + numLiveOuts * 4);
+        }
+    }
+}
+
+static void **slotOf(const Location *location, uintptr_t sp, uintptr_t fp)
+{
+    switch (location->type)
+    {
+    case LOCATION_INDIRECT:
+        if (location->reg == DWARF_RSP)
+        {
+            return (void **)(sp + location->offset);
+        }
+        if (location->reg == DWARF_RBP)
+        {
+            return (void **)(fp + location->offset);
+        }
+        fatal("unsupported stack map register");
+    case LOCATION_CONSTANT:
+    case LOCATION_CONSTANT_INDEX:
+        return NULL;
+    default:
+        fatal("unsupported stack map location");
+    }
+    return NULL;
+}
+
+/**
+ * Calls `visit` on every live object slot of the Eva frames above
+ * `framePointer`. Statepoint locations are: calling convention, flags,
+ * deopt count, the deopt values, then (base, derived) pairs.
+ */
+static void visitRoots(uintptr_t *framePointer, void *(*visit)(void *))
+{
+    for (uintptr_t *fp = framePointer; fp != NULL; fp = (uintptr_t *)fp[0])
+    {
+        const Safepoint *safepoint = findSafepoint(fp[1]);
+        if (safepoint == NULL)
+        {
+            break;
+        }
+
+        uintptr_t callerSp = (uintptr_t)(fp + 2);
+        uintptr_t callerFp = fp[0];
+
+        const Location *locations = safepoint->locations;
+        uint16_t first = 3 + locations[2].offset;
+        uint16_t pairs = (safepoint->count - first) / 2;
+
+        void **bases[pairs ? pairs : 1], **derived[pairs ? pairs : 1];
+        intptr_t deltas[pairs ? pairs : 1];
+
+        for (uint16_t i = 0; i < pairs; i++)
+        {
+            bases[i] = slotOf(&locations[first + 2 * i], callerSp, callerFp);
+            derived[i] = slotOf(&locations[first + 2 * i + 1], callerSp, callerFp);
+            deltas[i] = bases[i] && derived[i] ? (char *)*derived[i] - (char *)*bases[i] : 0;
+        }
+
+        // Derived pointers first, from the bases' original values.
+        for (uint16_t i = 0; i < pairs; i++)
+        {
+            if (derived[i] != NULL && derived[i] != bases[i])
+            {
+                *derived[i] = (char *)visit(*bases[i]) + deltas[i];
+            }
+        }
+        for (uint16_t i = 0; i < pairs; i++)
+        {
+            if (bases[i] != NULL)
+            {
+                *bases[i] = visit(*bases[i]);
+            }
+        }
+    }
+}
+
+/* -- Collection ------------------------------------------------------ */
+
+static void *allocateOld(const EvaObjectMap *map, uint64_t size)
+{
+    OldHeader *old = calloc(1, sizeof(OldHeader) + size);
+    if (old == NULL)
+    {
+        fatal("out of memory");
+    }
+
+    old->header.map = (uintptr_t)map;
+    old->next = oldObjects;
+    oldObjects = old;
+    oldBytes += size;
+
+    return &old->header + 1;
+}
+
+static void *evacuate(void *obj)
+{
+    if (obj == NULL || !inNursery(obj))
+    {
+        return obj;
+    }
+
+    Header *header = headerOf(obj);
+    if (header->map & FORWARDED)
+    {
+        return (void *)(header->map & ~(uintptr_t)FORWARDED);
+    }
+
+    const EvaObjectMap *map = (const EvaObjectMap *)header->map;
+    uint64_t size = objectSize(obj, map);
+    void *copy = allocateOld(map, size);
+    memcpy(copy, obj, size);
+    stats.promotedBytes += size;
+
+    header->map = (uintptr_t)copy | FORWARDED;
+    push(&gray, copy);
+    return copy;
+}
+
+static void scanObject(void *obj, void *(*visit)(void *))
+{
+    const EvaObjectMap *map = mapOf(obj);
+
+    if (map->count & ARRAY_MAP)
+    {
+        uint64_t count = map->count & ~ARRAY_MAP;
+        uint64_t length = *(uint64_t *)obj;
+        char *elements = (char *)obj + ARRAY_HEADER_SIZE;
+
+        for (uint64_t e = 0; count != 0 && e < length; e++)
+        {
+            for (uint64_t i = 0; i < count; i++)
+            {
+                void **slot = (void **)(elements + e * map->size + map->offsets[i]);
+                *slot = visit(*slot);
+            }
+        }
+        return;
+    }
+
+    for (uint64_t i = 0; i < map->count; i++)
+    {
+        void **slot = (void **)((char *)obj + map->offsets[i]);
+        *slot = visit(*slot);
+    }
+}
+
+static void *mark(void *obj)
+{
+    if (obj != NULL)
+    {
+        OldHeader *old = oldHeaderOf(obj);
+        if (!old->marked)
+        {
+            old->marked = 1;
+            push(&gray, obj);
+        }
+    }
+    return obj;
+}
+
+static void majorCollect(uintptr_t *framePointer)
+{
+    uint64_t start = nanos();
+
+    visitRoots(framePointer, mark);
+    while (gray.size > 0)
+    {
+        scanObject(gray.items[--gray.size], mark);
+    }
+
+    OldHeader **link = &oldObjects;
+    while (*link != NULL)
+    {
+        OldHeader *old = *link;
+        if (old->marked)
+        {
+            old->marked = 0;
+            link = &old->next;
+        }
+        else
+        {
+            *link = old->next;
+            oldBytes -= objectSize(&old->header + 1, (const EvaObjectMap *)old->header.map);
+            free(old);
+        }
+    }
+
+    majorThreshold = oldBytes * 2 > MIN_MAJOR_THRESHOLD ? oldBytes * 2 : MIN_MAJOR_THRESHOLD;
+
+    stats.major++;
+    stats.majorNanos += nanos() - start;
+}
+
+static void minorCollect(uintptr_t *framePointer)
+{
+    uint64_t start = nanos();
+
+    visitRoots(framePointer, evacuate);
+
+    for (size_t i = 0; i < remembered.size; i++)
+    {
+        void *obj = remembered.items[i];
+        oldHeaderOf(obj)->remembered = 0;
+        scanObject(obj, evacuate);
+    }
+    remembered.size = 0;
+
+    while (gray.size > 0)
+    {
+        scanObject(gray.items[--gray.size], evacuate);
+    }
+
+    nurseryCur = nurseryStart;
+
+    uint64_t elapsed = nanos() - start;
+    stats.minor++;
+    stats.minorNanos += elapsed;
+    stats.maxMinorNanos = elapsed > stats.maxMinorNanos ? elapsed : stats.maxMinorNanos;
+
+    if (oldBytes > majorThreshold)
+    {
+        majorCollect(framePointer);
+    }
+}
+
+static void printStats(void)
+{
+    fprintf(stderr,
+            "\nEvaGC: %zu minor (avg %.1f us, max %.1f us), %zu major (avg %.1f us), "
+            "%zu bytes promoted, %zu bytes old\n",
+            stats.minor, stats.minor ? stats.minorNanos / 1e3 / stats.minor : 0.0,
+            stats.maxMinorNanos / 1e3, stats.major,
+            stats.major ? stats.majorNanos / 1e3 / stats.major : 0.0,
+            stats.promotedBytes, oldBytes);
+}
+
+static void initialize(void)
+{
+    nurseryStart = malloc(NURSERY_SIZE);
+    if (nurseryStart == NULL)
+    {
+        fatal("out of memory");
+    }
+    nurseryCur = nurseryStart;
+    nurseryEnd = nurseryStart + NURSERY_SIZE;
+
+    loadStackMaps();
+
+    if (getenv("EVA_GC_STATS") != NULL)
+    {
+        atexit(printStats);
+    }
+}
+
+/* -- Entry points ---------------------------------------------------- */
+
+/**
+ * Allocates a zeroed object described by `map`. Called through a
+ * statepoint, so its caller's frame is the first one walked.
+ */
+__attribute__((noinline)) void *__eva_gc_alloc(uint64_t size, const EvaObjectMap *map)
+{
+    if (nurseryStart == NULL)
+    {
+        initialize();
+    }
+
+    if (size > LARGE_OBJECT_SIZE)
+    {
+        // Large objects never fill the nursery, so they have to trigger
+        // collections themselves. A minor collection first empties the
+        // nursery, whose objects the major one does not trace.
+        if (oldBytes + size > majorThreshold)
+        {
+            uintptr_t *framePointer = __builtin_frame_address(0);
+            minorCollect(framePointer);
+            if (oldBytes + size > majorThreshold)
+            {
+                majorCollect(framePointer);
+            }
+        }
+        return allocateOld(map, size);
+    }
+
+    size_t total = sizeof(Header) + ((size + 7) & ~(uint64_t)7);
+    if (nurseryCur + total > nurseryEnd)
+    {
+        minorCollect(__builtin_frame_address(0));
+    }
+
+    Header *header = (Header *)nurseryCur;
+    nurseryCur += total;
+
+    // Zeroed here rather than after each collection, so that minor
+    // collections only cost as much as the survivors.
+    memset(header + 1, 0, total - sizeof(Header));
+    header->map = (uintptr_t)map;
+    return header + 1;
+}
+
+/**
+ * Records old objects that get a pointer to a nursery object, so the
+ * next minor collection treats them as roots.
+ */
+void __eva_gc_write_barrier(void *obj, void *value)
+{
+    if (!inNursery(value) || inNursery(obj))
+    {
+        return;
+    }
+
+    OldHeader *old = oldHeaderOf(obj);
+    if (!old->remembered)
+    {
+        old->remembered = 1;
+        push(&remembered, obj);
+    }
+}